@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+# Convert a raw binary (eg, klipper.bin) to a UF2 file
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import argparse, struct
+
+UF2_MAGIC_START0 = 0x0A324655
+UF2_MAGIC_START1 = 0x9E5D5157
+UF2_MAGIC_END = 0x0AB16F30
+PAYLOAD_SIZE = 256
+
+def convert(content, address):
+    total = (len(content) + PAYLOAD_SIZE - 1) // PAYLOAD_SIZE
+    result = bytearray()
+    for current in range(total):
+        data = content[current * PAYLOAD_SIZE : (current + 1) * PAYLOAD_SIZE]
+        data += b"\xff" * (PAYLOAD_SIZE - len(data))
+        result.extend(struct.pack(
+            "<IIIIIIII", UF2_MAGIC_START0, UF2_MAGIC_START1, 0,
+            address + current * PAYLOAD_SIZE, PAYLOAD_SIZE, current, total,
+            0))
+        result.extend(data)
+        result.extend(bytearray(476 - PAYLOAD_SIZE))
+        result.extend(struct.pack("<I", UF2_MAGIC_END))
+    return result
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert binary to uf2")
+    parser.add_argument("-o", "--output", required=True, help="Output file")
+    parser.add_argument("-i", "--input",  required=True, help="Input file")
+    parser.add_argument("-a", "--address",  required=True,
+                        help="Flash address of the first byte of the binary")
+
+    args = parser.parse_args()
+    address = int(args.address, 0)
+    if address % PAYLOAD_SIZE:
+        # The bootloader rejects blocks that are not PAYLOAD_SIZE aligned
+        parser.error("address 0x%x is not a multiple of %d"
+                     % (address, PAYLOAD_SIZE))
+    with open(args.input, 'rb') as f:
+        content = f.read()
+    content = convert(content, address)
+    with open(args.output, 'wb') as f:
+        f.write(content)
+
+if __name__ == '__main__':
+    main()
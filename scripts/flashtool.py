@@ -15,6 +15,7 @@ import errno
 import argparse
 import hashlib
 import pathlib
+import time
 from typing import Dict, List, Optional, Union
 
 def output_line(msg: str) -> None:
@@ -65,7 +66,20 @@ CANBUS_CMD_QUERY_UNASSIGNED = 0x00
 CANBUS_CMD_SET_NODEID = 0x11
 CANBUS_CMD_CLEAR_NODE_ID = 0x12
 CANBUS_RESP_NEED_NODEID = 0x20
+CANBUS_RESP_NODEID_SET = 0x21
 CANBUS_NODEID_OFFSET = 128
+CANBUS_DISCOVERY_TIME = 3.
+CANBUS_QUERY_INTERVAL = .5
+
+# Session trace format
+TRACE_MAGIC = b"KTRC"
+TRACE_VERSION = 1
+TRACE_HEADER_FMT = "<4sBBI"
+TRACE_RECORD_FMT = "<BIIH"
+TRACE_TRANSPORT_CAN = 0
+TRACE_TRANSPORT_SERIAL = 1
+TRACE_DIR_TX = 0
+TRACE_DIR_RX = 1
 
 class FlashCanError(Exception):
     pass
@@ -272,6 +286,38 @@ class CanFlasher:
         await self.send_command("COMPLETE")
 
 
+class SessionTrace:
+    """Records every frame sent and received to a compact binary log
+
+    The log starts with a header (magic, version, transport, bitrate)
+    followed by one record per CAN frame or serial chunk: direction,
+    monotonic time in microseconds since the trace started, CAN ID (with
+    the EFF flag, zero for serial), data length, and the data itself.
+    """
+    def __init__(
+        self, path: pathlib.Path, transport: int, bitrate: int
+    ) -> None:
+        self._file = open(path, "wb")
+        self._file.write(struct.pack(
+            TRACE_HEADER_FMT, TRACE_MAGIC, TRACE_VERSION, transport, bitrate
+        ))
+        self._start = time.monotonic()
+
+    def record(self, direction: int, can_id: int, data: bytes) -> None:
+        if self._file is None:
+            return
+        usecs = int((time.monotonic() - self._start) * 1000000.)
+        self._file.write(struct.pack(
+            TRACE_RECORD_FMT, direction, usecs & 0xFFFFFFFF, can_id, len(data)
+        ))
+        self._file.write(data)
+
+    def close(self) -> None:
+        if self._file is None:
+            return
+        self._file.close()
+        self._file = None
+
 class CanNode:
     def __init__(self, node_id: int, cansocket: CanSocket) -> None:
         self.node_id = node_id
@@ -313,12 +359,33 @@ class CanNode:
     def close(self) -> None:
         self._reader.feed_eof()
 
+class CanAdminNode(CanNode):
+    """Queues admin responses one CAN frame at a time
+
+    Responses from several nodes may be buffered at once, and they do not
+    all have the same length, so they can not be read from a byte stream.
+    """
+    def __init__(self, node_id: int, cansocket: CanSocket) -> None:
+        super().__init__(node_id, cansocket)
+        self._frames: asyncio.Queue[bytes] = asyncio.Queue()
+
+    async def read_frame(self, timeout: Optional[float] = 2) -> bytes:
+        return await asyncio.wait_for(self._frames.get(), timeout)
+
+    def feed_data(self, data: bytes) -> None:
+        self._frames.put_nowait(data)
+
 class CanSocket:
-    def __init__(self, loop: asyncio.AbstractEventLoop):
+    def __init__(
+        self,
+        loop: asyncio.AbstractEventLoop,
+        trace: Optional[SessionTrace] = None
+    ):
         self._loop = loop
+        self._trace = trace
         self.cansock = socket.socket(socket.PF_CAN, socket.SOCK_RAW,
                                      socket.CAN_RAW)
-        self.admin_node = CanNode(CANBUS_ID_ADMIN, self)
+        self.admin_node = CanAdminNode(CANBUS_ID_ADMIN, self)
         self.nodes: Dict[int, CanNode] = {
             CANBUS_ID_ADMIN_RESP: self.admin_node
         }
@@ -356,8 +423,10 @@ class CanSocket:
 
     def _process_packet(self, packet: bytes) -> None:
         can_id, length, data = struct.unpack(CAN_FMT, packet)
-        can_id &= socket.CAN_EFF_MASK
         payload = data[:length]
+        if self._trace is not None:
+            self._trace.record(TRACE_DIR_RX, can_id, payload)
+        can_id &= socket.CAN_EFF_MASK
         node = self.nodes.get(can_id)
         if node is not None:
             node.feed_data(payload)
@@ -390,15 +459,19 @@ class CanSocket:
                 logging.info("Socket Write Error, closing")
                 self.close()
                 break
+            if self._trace is not None:
+                can_id, length, data = struct.unpack(CAN_FMT, packet)
+                self._trace.record(TRACE_DIR_TX, can_id, data[:length])
         self.output_busy = False
 
-    def _jump_to_bootloader(self, uuid: int):
-        # TODO: Send Klipper Admin command to jump to bootloader.
-        # It will need to be implemented
+    def _jump_to_bootloader(self, uuids: List[int]):
+        # Queue the reboot request for every node so they are sent
+        # back to back in a single burst
         output_line("Sending bootloader jump command...")
-        plist = [(uuid >> ((5 - i) * 8)) & 0xFF for i in range(6)]
-        plist.insert(0, KLIPPER_REBOOT_CMD)
-        self.send(KLIPPER_ADMIN_ID, bytes(plist))
+        for uuid in uuids:
+            plist = [(uuid >> ((5 - i) * 8)) & 0xFF for i in range(6)]
+            plist.insert(0, KLIPPER_REBOOT_CMD)
+            self.send(KLIPPER_ADMIN_ID, bytes(plist))
 
     async def _query_uuids(self) -> List[int]:
         output_line("Checking for Katapult nodes...")
@@ -410,7 +483,7 @@ class CanSocket:
         while curtime < endtime:
             timeout = max(.1, endtime - curtime)
             try:
-                resp = await self.admin_node.read(8, timeout)
+                resp = await self.admin_node.read_frame(timeout)
             except asyncio.TimeoutError:
                 continue
             finally:
@@ -436,21 +509,92 @@ class CanSocket:
         payload = bytes([CANBUS_CMD_CLEAR_NODE_ID])
         self.admin_node.write(payload)
 
-    def _set_node_id(self, uuid: int) -> CanNode:
+    def _send_node_id(self, uuid: int, node_id: int) -> None:
         # Convert ID to a list
         plist = [(uuid >> ((5 - i) * 8)) & 0xFF for i in range(6)]
         plist.insert(0, CANBUS_CMD_SET_NODEID)
-        node_id = len(self.nodes) + CANBUS_NODEID_OFFSET
         plist.append(node_id)
         payload = bytes(plist)
         self.admin_node.write(payload)
+
+    def _set_node_id(self, uuid: int) -> CanNode:
+        node_id = len(self.nodes) + CANBUS_NODEID_OFFSET
+        self._send_node_id(uuid, node_id)
         decoded_id = node_id * 2 + 0x100
         node = CanNode(decoded_id, self)
         self.nodes[decoded_id + 1] = node
         return node
 
+    async def _discover_nodes(self, uuids: List[int]) -> Dict[int, CanNode]:
+        # Query repeatedly while the nodes come up and assign each node
+        # an ID as soon as it answers.  The bootloader acknowledges the
+        # assignment, so the pass ends once every node has been assigned.
+        output_line("Waiting for Katapult nodes...")
+        query = bytes([CANBUS_CMD_QUERY_UNASSIGNED])
+        pending: Dict[int, CanNode] = {}
+        assigned: Dict[int, CanNode] = {}
+        curtime = self._loop.time()
+        endtime = curtime + CANBUS_DISCOVERY_TIME
+        next_query = curtime
+        while curtime < endtime and len(assigned) < len(uuids):
+            if curtime >= next_query:
+                self.admin_node.write(query)
+                next_query = curtime + CANBUS_QUERY_INTERVAL
+            timeout = max(.01, min(next_query, endtime) - curtime)
+            try:
+                resp = await self.admin_node.read_frame(timeout)
+            except asyncio.TimeoutError:
+                continue
+            finally:
+                curtime = self._loop.time()
+            if len(resp) < 8:
+                # Not a bootloader response
+                continue
+            uuid = sum([v << ((5 - i) * 8) for i, v in enumerate(resp[1:7])])
+            if uuid not in uuids or uuid in assigned:
+                continue
+            if resp[0] == CANBUS_RESP_NEED_NODEID:
+                if resp[7] != CANBUS_CMD_SET_NODEID:
+                    continue
+                node = pending.get(uuid)
+                if node is None:
+                    output_line(f"Detected UUID: {resp[1:7].hex()}")
+                    pending[uuid] = self._set_node_id(uuid)
+                else:
+                    # Previous assignment was lost, resend it
+                    self._send_node_id(uuid, (node.node_id - 0x100) >> 1)
+            elif resp[0] == CANBUS_RESP_NODEID_SET:
+                node = pending.get(uuid)
+                if node is None or resp[7] != (node.node_id - 0x100) >> 1:
+                    continue
+                assigned[uuid] = pending.pop(uuid)
+        for uuid, node in pending.items():
+            # Older bootloaders do not acknowledge the assignment
+            logging.info(f"No node ID acknowledgement from {uuid:012x}")
+            assigned[uuid] = node
+        return assigned
+
+    async def _flash_node(
+        self, uuid: int, node: CanNode, fw_path: pathlib.Path
+    ) -> None:
+        flasher = CanFlasher(node, fw_path)
+        try:
+            await flasher.connect_btl()
+            await flasher.verify_canbus_uuid(uuid)
+            await flasher.send_file()
+            await flasher.verify_file()
+        finally:
+            # always attempt to send the complete command. If
+            # there is an error it will exit the bootloader
+            # unless comms were broken
+            await flasher.finish()
+
     async def run(
-        self, intf: str, uuid: int, fw_path: pathlib.Path, req_only: bool
+        self,
+        intf: str,
+        uuids: List[int],
+        fw_path: pathlib.Path,
+        req_only: bool
     ) -> None:
         if not req_only and not fw_path.is_file():
             raise FlashCanError("Invalid firmware path '%s'" % (fw_path))
@@ -462,31 +606,39 @@ class CanSocket:
         self.cansock.setblocking(False)
         self._loop.add_reader(
             self.cansock.fileno(), self._handle_can_response)
-        self._jump_to_bootloader(uuid)
+        self._jump_to_bootloader(uuids)
         if req_only:
             output_line("Bootloader request command sent")
             return
-        await asyncio.sleep(.5)
         self._reset_nodes()
-        await asyncio.sleep(.5)
-        id_list = await self._query_uuids()
-        if uuid not in id_list:
+        nodes = await self._discover_nodes(uuids)
+        # A failure on one node must not leave the remaining nodes
+        # waiting in the bootloader, so flash each node independently
+        results: Dict[int, str] = {}
+        for uuid in uuids:
+            node = nodes.get(uuid)
+            if node is None:
+                output_line(f"Unable to find node matching UUID: {uuid:012x}")
+                results[uuid] = "Not found"
+                continue
+            if len(uuids) > 1:
+                output_line(f"\nFlashing node {uuid:012x}")
+            try:
+                await self._flash_node(uuid, node, fw_path)
+            except Exception as e:
+                logging.exception(f"Flash error on node {uuid:012x}")
+                results[uuid] = f"Failed ({e})"
+            else:
+                results[uuid] = "Success"
+        if len(uuids) > 1:
+            output_line("\nResults:")
+            for uuid, result in results.items():
+                output_line(f"  {uuid:012x}: {result}")
+        failed = [uuid for uuid, res in results.items() if res != "Success"]
+        if failed:
             raise FlashCanError(
-                f"Unable to find node matching UUID: {uuid:012x}"
+                "Flash failed on %d of %d nodes" % (len(failed), len(uuids))
             )
-        node = self._set_node_id(uuid)
-        flasher = CanFlasher(node, fw_path)
-        await asyncio.sleep(.5)
-        try:
-            await flasher.connect_btl()
-            await flasher.verify_canbus_uuid(uuid)
-            await flasher.send_file()
-            await flasher.verify_file()
-        finally:
-            # always attempt to send the complete command. If
-            # there is an error it will exit the bootloader
-            # unless comms were broken
-            await flasher.finish()
 
     async def run_query(self, intf: str):
         try:
@@ -511,8 +663,13 @@ class CanSocket:
         self.cansock.close()
 
 class SerialSocket:
-    def __init__(self, loop: asyncio.AbstractEventLoop):
+    def __init__(
+        self,
+        loop: asyncio.AbstractEventLoop,
+        trace: Optional[SessionTrace] = None
+    ):
         self._loop = loop
+        self._trace = trace
         self.serial = self.serial_error = None
         self.node = CanNode(0, self)
 
@@ -522,6 +679,8 @@ class SerialSocket:
         except self.serial_error as e:
             logging.exception("Error on serial read")
             self.close()
+        if self._trace is not None:
+            self._trace.record(TRACE_DIR_RX, 0, data)
         self.node.feed_data(data)
 
     def send(self, can_id: int, payload: bytes = b"") -> None:
@@ -530,6 +689,9 @@ class SerialSocket:
         except self.serial_error as e:
             logging.exception("Error on serial write")
             self.close()
+        else:
+            if self._trace is not None:
+                self._trace.record(TRACE_DIR_TX, 0, payload)
 
     async def run(self, intf: str, baud: int, fw_path: pathlib.Path) -> None:
         if not fw_path.is_file():
@@ -577,8 +739,8 @@ def main():
         help="Serial Device"
     )
     parser.add_argument(
-        "-b", "--baud", default=250000, metavar='<baud rate>',
-        help="Serial baud rate"
+        "-b", "--baud", default=None, type=int, metavar='<baud rate>',
+        help="Serial baud rate (default 250000)"
     )
     parser.add_argument(
         "-i", "--interface", default="can0", metavar='<can interface>',
@@ -590,7 +752,7 @@ def main():
         help="Path to Klipper firmware file")
     parser.add_argument(
         "-u", "--uuid", metavar="<uuid>", default=None,
-        help="Can device uuid"
+        help="Can device uuid (comma separated list for multiple devices)"
     )
     parser.add_argument(
         "-q", "--query", action="store_true",
@@ -604,6 +766,15 @@ def main():
         "-r", "--request-bootloader", action="store_true",
         help="Requests the bootloader and exits (CAN only)"
     )
+    parser.add_argument(
+        "-t", "--trace", metavar="<trace file>", default=None,
+        help="Record a timing trace of all frames sent and received"
+    )
+    parser.add_argument(
+        "--bitrate", metavar="<bitrate>", type=int, default=0,
+        help="Line rate to store in the trace file (CAN bitrate or UART "
+             "baud, default unknown)"
+    )
 
     args = parser.parse_args()
     if not args.verbose:
@@ -613,10 +784,23 @@ def main():
     loop = asyncio.get_event_loop()
     iscan = args.device is None
     req_only = args.request_bootloader
+    baud = 250000 if args.baud is None else args.baud
     sock = None
+    trace = None
+    if args.trace is not None:
+        tpath = pathlib.Path(args.trace).expanduser().resolve()
+        if iscan:
+            trace = SessionTrace(tpath, TRACE_TRANSPORT_CAN, args.bitrate)
+        else:
+            # The baud rate only describes the wire for a UART, so it is
+            # recorded only when given explicitly (0 means unknown)
+            rate = args.bitrate
+            if not rate and args.baud is not None:
+                rate = args.baud
+            trace = SessionTrace(tpath, TRACE_TRANSPORT_SERIAL, rate)
     try:
         if iscan:
-            sock = CanSocket(loop)
+            sock = CanSocket(loop, trace)
             if args.query:
                 loop.run_until_complete(sock.run_query(intf))
             else:
@@ -624,21 +808,28 @@ def main():
                     raise FlashCanError(
                         "The 'uuid' option must be specified to flash a device"
                     )
-                uuid = int(args.uuid, 16)
-                loop.run_until_complete(sock.run(intf, uuid, fpath, req_only))
+                # Drop repeated UUIDs, keeping the order given
+                uuids = list(dict.fromkeys(
+                    int(u, 16) for u in args.uuid.split(",")
+                ))
+                loop.run_until_complete(
+                    sock.run(intf, uuids, fpath, req_only)
+                )
         else:
             if args.device is None:
                 raise FlashCanError(
                     "The 'device' option must be specified to flash a device"
                 )
-            sock = SerialSocket(loop)
-            loop.run_until_complete(sock.run(args.device, args.baud, fpath))
+            sock = SerialSocket(loop, trace)
+            loop.run_until_complete(sock.run(args.device, baud, fpath))
     except Exception as e:
         logging.exception("Flash Error")
         sys.exit(-1)
     finally:
         if sock is not None:
             sock.close()
+        if trace is not None:
+            trace.close()
     if args.query:
         output_line("Query Complete")
     else:
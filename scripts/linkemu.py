@@ -0,0 +1,760 @@
+#!/usr/bin/env python3
+# Link impairment emulator for benchmarking Katapult transfers
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+from __future__ import annotations
+import sys
+import os
+import asyncio
+import socket
+import struct
+import logging
+import argparse
+import random
+import signal
+import tty
+from typing import Callable, Dict, List, Optional, Set, Tuple
+from trace_analyze import can_frame_bits, uart_bits
+
+def output_line(msg: str) -> None:
+    sys.stdout.write(msg + "\n")
+    sys.stdout.flush()
+
+# Standard crc16 ccitt, take from msgproto.py in Klipper
+def crc16_ccitt(buf: bytes) -> int:
+    crc = 0xffff
+    for data in buf:
+        data ^= crc & 0xff
+        data ^= (data & 0x0f) << 4
+        crc = ((data << 8) | (crc >> 8)) ^ (data >> 4) ^ (data << 3)
+    return crc & 0xFFFF
+
+logging.basicConfig(level=logging.INFO)
+CAN_FMT = "<IB3x8s"
+
+# Katapult Defs
+CMD_HEADER = b'\x01\x88'
+CMD_TRAILER = b'\x99\x03'
+CMD_CONNECT = 0x11
+CMD_SEND_BLOCK = 0x12
+CMD_SEND_EOF = 0x13
+CMD_REQUEST_BLOCK = 0x14
+CMD_COMPLETE = 0x15
+CMD_GET_CANBUS_ID = 0x16
+ACK_SUCCESS = 0xa0
+NACK = 0xf1
+COMMAND_ERROR = 0xf2
+PROTO_VERSION = 0x00010001
+MESSAGE_MIN = 8
+MESSAGE_MAX = 8 + 255 * 4
+
+# CAN Admin Defs
+CANBUS_ID_ADMIN = 0x3f0
+CANBUS_ID_ADMIN_RESP = 0x3f1
+CANBUS_CMD_QUERY_UNASSIGNED = 0x00
+CANBUS_CMD_SET_NODEID = 0x11
+CANBUS_CMD_CLEAR_NODE_ID = 0x12
+CANBUS_RESP_NEED_NODEID = 0x20
+CANBUS_RESP_NODEID_SET = 0x21
+
+class LinkEmuError(Exception):
+    pass
+
+def handle_sigterm(signum, frame) -> None:
+    # Treat a termination request like Ctrl-C so the report is printed
+    raise KeyboardInterrupt()
+
+def build_frame(cmd: int, payload: bytes = b"") -> bytes:
+    out = bytearray(CMD_HEADER)
+    out.append(cmd)
+    out.append((len(payload) // 4) & 0xFF)
+    out.extend(payload)
+    out.extend(struct.pack("<H", crc16_ccitt(out[2:])))
+    out.extend(CMD_TRAILER)
+    return bytes(out)
+
+class FrameParser:
+    """Extract well formed Katapult frames from a byte stream"""
+    def __init__(self, callback: Callable[[bytes], None]) -> None:
+        self.callback = callback
+        self.buf = bytearray()
+
+    def feed(self, data: bytes) -> None:
+        self.buf.extend(data)
+        while len(self.buf) >= MESSAGE_MIN:
+            if self.buf[:2] != CMD_HEADER:
+                idx = self.buf.find(CMD_HEADER[:1], 1)
+                if idx < 0:
+                    self.buf.clear()
+                else:
+                    del self.buf[:idx]
+                continue
+            msglen = self.buf[3] * 4 + 8
+            if len(self.buf) < msglen:
+                break
+            frame = bytes(self.buf[:msglen])
+            crc, = struct.unpack("<H", frame[-4:-2])
+            if (frame[-2:] != CMD_TRAILER
+                    or crc != crc16_ccitt(frame[2:-4])):
+                del self.buf[:1]
+                continue
+            del self.buf[:msglen]
+            self.callback(frame)
+
+
+######################################################################
+# Impairment model
+######################################################################
+
+class Impairment:
+    def __init__(self, args: argparse.Namespace) -> None:
+        self.frame_loss: float = args.frame_loss
+        self.byte_loss: float = args.byte_loss
+        self.ber: float = args.ber
+        self.reorder: float = args.reorder
+        self.latency: float = args.latency / 1000.
+        self.jitter: float = args.jitter / 1000.
+        self.rate: int = args.rate
+        self.rng = random.Random(args.seed)
+
+    def corrupt(self, data: bytes) -> Tuple[bytes, int, int]:
+        # Returns the impaired data, dropped byte count and flipped bits
+        if not self.byte_loss and not self.ber:
+            return data, 0, 0
+        out = bytearray()
+        dropped = flipped = 0
+        for byte in data:
+            if self.byte_loss and self.rng.random() < self.byte_loss:
+                dropped += 1
+                continue
+            if self.ber:
+                for bit in range(8):
+                    if self.rng.random() < self.ber:
+                        byte ^= 1 << bit
+                        flipped += 1
+            out.append(byte)
+        return bytes(out), dropped, flipped
+
+class DirectionStats:
+    def __init__(self) -> None:
+        self.units = 0
+        self.bytes = 0
+        self.frames_dropped = 0
+        self.bytes_dropped = 0
+        self.bits_flipped = 0
+        self.reordered = 0
+
+class ImpairedLink:
+    """Delivers units (serial chunks or CAN frames) in one direction"""
+    def __init__(
+        self,
+        loop: asyncio.AbstractEventLoop,
+        impairment: Impairment,
+        deliver: Callable[[bytes], None],
+        is_can: bool
+    ) -> None:
+        self._loop = loop
+        self.imp = impairment
+        self.deliver = deliver
+        self.is_can = is_can
+        self.stats = DirectionStats()
+        self.last_delivery = 0.
+        self.busy_until = 0.
+
+    def _payload_size(self, data: bytes) -> int:
+        if self.is_can:
+            # CAN units are packed can_frame structs, use the DLC
+            return min(data[4], 8)
+        return len(data)
+
+    def _wire_time(self, data: bytes) -> float:
+        # Uses the same bit model as trace_analyze.py
+        if not self.imp.rate:
+            return 0.
+        if self.is_can:
+            can_id, = struct.unpack_from("<I", data)
+            bits = can_frame_bits(self._payload_size(data),
+                                  bool(can_id & socket.CAN_EFF_FLAG))
+        else:
+            bits = uart_bits(len(data))
+        return bits / float(self.imp.rate)
+
+    def send(self, data: bytes) -> None:
+        imp = self.imp
+        stats = self.stats
+        stats.units += 1
+        stats.bytes += self._payload_size(data)
+        if imp.frame_loss and imp.rng.random() < imp.frame_loss:
+            stats.frames_dropped += 1
+            return
+        if self.is_can:
+            # Bit errors in a CAN frame are caught by the controller CRC
+            # and retransmitted in hardware, so only loss applies
+            dropped = flipped = 0
+        else:
+            data, dropped, flipped = imp.corrupt(data)
+        stats.bytes_dropped += dropped
+        stats.bits_flipped += flipped
+        if not data:
+            return
+        now = self._loop.time()
+        wire_time = self._wire_time(data)
+        self.busy_until = max(now, self.busy_until) + wire_time
+        deliver_time = self.busy_until + imp.latency
+        if imp.jitter:
+            deliver_time += imp.rng.uniform(0., imp.jitter)
+        if imp.reorder and imp.rng.random() < imp.reorder:
+            # Hold this unit back so that later traffic overtakes it
+            stats.reordered += 1
+            deliver_time += max(imp.latency, imp.jitter, .010)
+        else:
+            deliver_time = max(deliver_time, self.last_delivery)
+            self.last_delivery = deliver_time
+        self._loop.call_at(deliver_time, self.deliver, data)
+
+
+######################################################################
+# Transfer statistics
+######################################################################
+
+class TransferMonitor:
+    """Tracks Katapult frames on both sides of the emulated link"""
+    def __init__(self, loop: asyncio.AbstractEventLoop) -> None:
+        self._loop = loop
+        self.host_parser = FrameParser(self._handle_host_frame)
+        self.dev_parser = FrameParser(self._handle_device_frame)
+        self.start_time: Optional[float] = None
+        self.end_time = 0.
+        self.commands = 0
+        self.retries = 0
+        self.nacks = 0
+        self.cmd_errors = 0
+        self.last_cmd = b""
+        self.block_sizes: Dict[int, int] = {}
+        self.written: Set[int] = set()
+        self.verified: Set[int] = set()
+        # Unique image bytes and first command/last ack times per phase
+        self.write_bytes = self.verify_bytes = 0
+        self.write_span: List[float] = []
+        self.verify_span: List[float] = []
+
+    def host_sent(self, data: bytes) -> None:
+        if self.start_time is None:
+            self.start_time = self._loop.time()
+        self.host_parser.feed(data)
+
+    def host_received(self, data: bytes) -> None:
+        self.end_time = self._loop.time()
+        self.dev_parser.feed(data)
+
+    def _handle_host_frame(self, frame: bytes) -> None:
+        self.commands += 1
+        if frame == self.last_cmd:
+            # flashtool resends an identical frame after a timeout or NACK
+            self.retries += 1
+        self.last_cmd = frame
+        now = self._loop.time()
+        if frame[2] == CMD_SEND_BLOCK and frame[3] > 1:
+            addr, = struct.unpack("<I", frame[4:8])
+            self.block_sizes[addr] = frame[3] * 4 - 4
+            if not self.write_span:
+                self.write_span = [now, now]
+        elif frame[2] == CMD_REQUEST_BLOCK and not self.verify_span:
+            self.verify_span = [now, now]
+
+    def _handle_device_frame(self, frame: bytes) -> None:
+        resp = frame[2]
+        if resp == NACK:
+            self.nacks += 1
+            return
+        if resp == COMMAND_ERROR:
+            self.cmd_errors += 1
+            return
+        if resp != ACK_SUCCESS or frame[3] < 2:
+            return
+        cmd, addr = struct.unpack("<II", frame[4:12])
+        now = self._loop.time()
+        if cmd == CMD_SEND_BLOCK and addr not in self.written:
+            self.written.add(addr)
+            self.write_bytes += self.block_sizes.get(addr, 0)
+            if self.write_span:
+                self.write_span[1] = now
+        elif cmd == CMD_REQUEST_BLOCK and addr not in self.verified:
+            self.verified.add(addr)
+            self.verify_bytes += frame[3] * 4 - 8
+            if self.verify_span:
+                self.verify_span[1] = now
+
+    def report(self, links: Dict[str, ImpairedLink]) -> None:
+        output_line("\nLink Emulator Report")
+        for name, link in links.items():
+            st = link.stats
+            output_line(
+                f"  {name}: {st.units} units, {st.bytes} bytes, "
+                f"{st.frames_dropped} dropped, {st.bytes_dropped} bytes lost, "
+                f"{st.bits_flipped} bits flipped, {st.reordered} reordered"
+            )
+        elapsed = 0.
+        if self.start_time is not None:
+            elapsed = max(0., self.end_time - self.start_time)
+        output_line(
+            f"  Commands: {self.commands}, Retries: {self.retries}, "
+            f"NACKs: {self.nacks}, Command Errors: {self.cmd_errors}"
+        )
+        output_line(
+            f"  Blocks written: {len(self.written)}, "
+            f"Blocks verified: {len(self.verified)}"
+        )
+        output_line(f"  Elapsed: {elapsed:.3f}s")
+        for name, nbytes, span in (
+            ("Write", self.write_bytes, self.write_span),
+            ("Verify", self.verify_bytes, self.verify_span)
+        ):
+            if not span:
+                continue
+            duration = span[1] - span[0]
+            goodput = nbytes / duration if duration > 0. else 0.
+            output_line(
+                f"  {name}: {nbytes} image bytes in {duration:.3f}s, "
+                f"Goodput: {goodput:.1f} bytes/s"
+            )
+
+
+######################################################################
+# Stand-in bootloader
+######################################################################
+
+class StandinDevice:
+    """Minimal emulation of the Katapult command set"""
+    def __init__(
+        self,
+        loop: asyncio.AbstractEventLoop,
+        send: Callable[[bytes], None],
+        args: argparse.Namespace
+    ) -> None:
+        self._loop = loop
+        self.send = send
+        self.block_size: int = args.block_size
+        self.start_addr: int = args.start_address
+        self.service_time: float = args.service_time / 1000.
+        self.uuid: int = args.standin_uuid
+        self.mcu = b"linkemu"
+        self.flash: Dict[int, bytes] = {}
+        self.buf = bytearray()
+        self.need_valid = False
+        self.busy_until = 0.
+
+    def _respond(self, frame: bytes) -> None:
+        # Responses are serialized behind the emulated processing time
+        now = self._loop.time()
+        self.busy_until = max(now, self.busy_until) + self.service_time
+        self._loop.call_at(self.busy_until, self.send, frame)
+
+    def _ack(self, cmd: int, payload: bytes = b"") -> None:
+        self._respond(build_frame(ACK_SUCCESS, struct.pack("<I", cmd)
+                                  + payload))
+
+    def feed(self, data: bytes) -> None:
+        # Mirrors command_find_block() in src/command.c
+        self.buf.extend(data)
+        while self.buf:
+            buf = self.buf
+            if len(buf) < MESSAGE_MIN:
+                return
+            msglen = buf[3] * 4 + 8
+            valid = buf[:2] == CMD_HEADER and msglen <= MESSAGE_MAX
+            if valid and len(buf) < msglen:
+                return
+            if valid:
+                crc, = struct.unpack("<H", buf[msglen-4:msglen-2])
+                valid = (buf[msglen-2:msglen] == CMD_TRAILER
+                         and crc == crc16_ccitt(buf[2:msglen-4]))
+            if not valid:
+                idx = buf.find(CMD_HEADER[:1], 1)
+                del buf[:idx if idx > 0 else len(buf)]
+                if not self.need_valid:
+                    self.need_valid = True
+                    self._respond(build_frame(NACK))
+                continue
+            self.need_valid = False
+            frame = bytes(buf[:msglen])
+            del buf[:msglen]
+            self._dispatch(frame[2], frame[4:-4])
+
+    def _dispatch(self, cmd: int, payload: bytes) -> None:
+        bsize = self.block_size
+        if cmd == CMD_CONNECT:
+            mcu = self.mcu + b"\x00" * (-len(self.mcu) % 4)
+            self._ack(cmd, struct.pack("<III", PROTO_VERSION,
+                                       self.start_addr, bsize) + mcu)
+        elif cmd == CMD_SEND_BLOCK and len(payload) == bsize + 4:
+            addr, = struct.unpack("<I", payload[:4])
+            if addr < self.start_addr:
+                self._respond(build_frame(COMMAND_ERROR))
+                return
+            self.flash[addr] = payload[4:]
+            self._ack(cmd, payload[:4])
+        elif cmd == CMD_SEND_EOF:
+            self._ack(cmd, struct.pack("<I", len(self.flash)))
+        elif cmd == CMD_REQUEST_BLOCK and len(payload) == 4:
+            addr, = struct.unpack("<I", payload)
+            data = self.flash.get(addr, b"\xff" * bsize)
+            self._ack(cmd, payload + data)
+        elif cmd == CMD_COMPLETE:
+            self._ack(cmd)
+        elif cmd == CMD_GET_CANBUS_ID:
+            self._ack(cmd, self.uuid.to_bytes(6, "big") + b"\x00\x00")
+        else:
+            self._respond(build_frame(COMMAND_ERROR))
+
+class StandinCanNode:
+    """Wraps a StandinDevice with the CAN admin protocol"""
+    def __init__(
+        self,
+        loop: asyncio.AbstractEventLoop,
+        send_frame: Callable[[int, bytes], None],
+        args: argparse.Namespace
+    ) -> None:
+        self.send_frame = send_frame
+        self.uuid: int = args.standin_uuid
+        self.assigned_id = 0
+        self.device = StandinDevice(loop, self._send_data, args)
+
+    def _send_data(self, data: bytes) -> None:
+        if not self.assigned_id:
+            return
+        for i in range(0, len(data), 8):
+            self.send_frame(self.assigned_id + 1, data[i:i+8])
+
+    def handle_frame(self, can_id: int, data: bytes) -> None:
+        if self.assigned_id and can_id == self.assigned_id:
+            self.device.feed(data)
+            return
+        if can_id != CANBUS_ID_ADMIN or not data:
+            return
+        uuid_bytes = self.uuid.to_bytes(6, "big")
+        cmd = data[0]
+        if cmd == CANBUS_CMD_QUERY_UNASSIGNED and not self.assigned_id:
+            self.send_frame(
+                CANBUS_ID_ADMIN_RESP,
+                bytes([CANBUS_RESP_NEED_NODEID]) + uuid_bytes
+                + bytes([CANBUS_CMD_SET_NODEID])
+            )
+        elif cmd == CANBUS_CMD_SET_NODEID and len(data) >= 8:
+            if data[1:7] == uuid_bytes:
+                self.assigned_id = (data[7] << 1) + 0x100
+                self.send_frame(
+                    CANBUS_ID_ADMIN_RESP,
+                    bytes([CANBUS_RESP_NODEID_SET]) + uuid_bytes
+                    + data[7:8]
+                )
+        elif cmd == CANBUS_CMD_CLEAR_NODE_ID:
+            self.assigned_id = 0
+
+
+######################################################################
+# Transports
+######################################################################
+
+class SerialEmulator:
+    """Proxies a pty exposed to flashtool to a serial device or stand-in"""
+    def __init__(
+        self, loop: asyncio.AbstractEventLoop, args: argparse.Namespace
+    ) -> None:
+        self._loop = loop
+        self.args = args
+        self.monitor = TransferMonitor(loop)
+        imp = Impairment(args)
+        self.to_device = ImpairedLink(loop, imp, self._write_device, False)
+        self.to_host = ImpairedLink(loop, imp, self._write_host, False)
+        self.master_fd = self.slave_fd = -1
+        self.serial = None
+        self.standin: Optional[StandinDevice] = None
+
+    def _write_host(self, data: bytes) -> None:
+        self.monitor.host_received(data)
+        try:
+            os.write(self.master_fd, data)
+        except OSError:
+            logging.exception("Error writing to pty")
+
+    def _write_device(self, data: bytes) -> None:
+        if self.standin is not None:
+            self.standin.feed(data)
+        else:
+            self.serial.write(data)
+
+    def _handle_host_data(self) -> None:
+        try:
+            data = os.read(self.master_fd, 4096)
+        except OSError:
+            # No process has the pty open
+            return
+        self.monitor.host_sent(data)
+        self.to_device.send(data)
+
+    def _handle_device_data(self) -> None:
+        data = self.serial.read(4096)
+        if data:
+            self.to_host.send(data)
+
+    def _open_device(self, dev: str, baud: int) -> None:
+        try:
+            import serial
+        except ModuleNotFoundError:
+            raise LinkEmuError(
+                "The pyserial python package was not found.  To install "
+                "run the following command in a terminal: \n\n"
+                "   pip3 install pyserial\n\n")
+        try:
+            self.serial = serial.Serial(dev, baudrate=baud, timeout=0,
+                                        exclusive=True)
+        except (OSError, IOError, serial.SerialException) as e:
+            raise LinkEmuError("Unable to open serial port: %s" % (e,))
+        self._loop.add_reader(self.serial.fileno(), self._handle_device_data)
+
+    async def run(self) -> None:
+        args = self.args
+        if args.device is None:
+            self.standin = StandinDevice(self._loop, self.to_host.send, args)
+        else:
+            self._open_device(args.device, args.baud)
+        self.master_fd, self.slave_fd = os.openpty()
+        tty.setraw(self.slave_fd)
+        os.set_blocking(self.master_fd, False)
+        pty_name = os.ttyname(self.slave_fd)
+        if args.link is not None:
+            if os.path.lexists(args.link):
+                os.unlink(args.link)
+            os.symlink(pty_name, args.link)
+            pty_name = args.link
+        self._loop.add_reader(self.master_fd, self._handle_host_data)
+        target = args.device or "stand-in device"
+        output_line(f"Emulated link ready: {pty_name} <-> {target}")
+        output_line(f"Run: flashtool.py -d {pty_name}")
+        await asyncio.Event().wait()
+
+    def report(self) -> None:
+        self.monitor.report({
+            "host->device": self.to_device, "device->host": self.to_host
+        })
+
+    def close(self) -> None:
+        if self.master_fd >= 0:
+            self._loop.remove_reader(self.master_fd)
+            os.close(self.master_fd)
+            os.close(self.slave_fd)
+            self.master_fd = self.slave_fd = -1
+        if self.args.link is not None and os.path.islink(self.args.link):
+            os.unlink(self.args.link)
+        if self.serial is not None:
+            self._loop.remove_reader(self.serial.fileno())
+            self.serial.close()
+            self.serial = None
+
+class CanEmulator:
+    """Bridges two CAN interfaces, or a CAN interface and a stand-in"""
+    def __init__(
+        self, loop: asyncio.AbstractEventLoop, args: argparse.Namespace
+    ) -> None:
+        self._loop = loop
+        self.args = args
+        self.monitor = TransferMonitor(loop)
+        imp = Impairment(args)
+        self.to_device = ImpairedLink(loop, imp, self._write_device, True)
+        self.to_host = ImpairedLink(loop, imp, self._write_host, True)
+        self.host_sock: Optional[socket.socket] = None
+        self.dev_sock: Optional[socket.socket] = None
+        self.standin: Optional[StandinCanNode] = None
+        # Node ids handed out on the host bus, used to follow data frames
+        self.node_ids: Set[int] = set()
+
+    def _open(self, intf: str) -> socket.socket:
+        sock = socket.socket(socket.PF_CAN, socket.SOCK_RAW, socket.CAN_RAW)
+        try:
+            sock.bind((intf,))
+        except Exception:
+            raise LinkEmuError("Unable to bind socket to %s" % (intf,))
+        sock.setblocking(False)
+        return sock
+
+    @staticmethod
+    def _pack(can_id: int, data: bytes) -> bytes:
+        if can_id > 0x7FF:
+            can_id |= socket.CAN_EFF_FLAG
+        return struct.pack(CAN_FMT, can_id, len(data), data)
+
+    @staticmethod
+    def _unpack(packet: bytes) -> Tuple[int, bytes]:
+        can_id, length, data = struct.unpack(CAN_FMT, packet)
+        return can_id & socket.CAN_EFF_MASK, data[:length]
+
+    def _write_host(self, packet: bytes) -> None:
+        can_id, data = self._unpack(packet)
+        if can_id - 1 in self.node_ids:
+            self.monitor.host_received(data)
+        try:
+            self.host_sock.send(packet)
+        except socket.error:
+            logging.exception("Host CAN write error")
+
+    def _write_device(self, packet: bytes) -> None:
+        if self.standin is not None:
+            self.standin.handle_frame(*self._unpack(packet))
+            return
+        try:
+            self.dev_sock.send(packet)
+        except socket.error:
+            logging.exception("Device CAN write error")
+
+    def _standin_send(self, can_id: int, data: bytes) -> None:
+        self.to_host.send(self._pack(can_id, data))
+
+    def _handle_host_data(self) -> None:
+        try:
+            packet = self.host_sock.recv(16)
+        except socket.error:
+            return
+        can_id, data = self._unpack(packet)
+        if can_id == CANBUS_ID_ADMIN and data[:1] == bytes(
+                [CANBUS_CMD_SET_NODEID]) and len(data) >= 8:
+            self.node_ids.add((data[7] << 1) + 0x100)
+        elif can_id in self.node_ids:
+            self.monitor.host_sent(data)
+        self.to_device.send(packet)
+
+    def _handle_device_data(self) -> None:
+        try:
+            packet = self.dev_sock.recv(16)
+        except socket.error:
+            return
+        self.to_host.send(packet)
+
+    async def run(self) -> None:
+        args = self.args
+        self.host_sock = self._open(args.interface)
+        self._loop.add_reader(self.host_sock.fileno(), self._handle_host_data)
+        if args.device_interface is None:
+            self.standin = StandinCanNode(self._loop, self._standin_send, args)
+            target = f"stand-in device (uuid {args.standin_uuid:012x})"
+        else:
+            self.dev_sock = self._open(args.device_interface)
+            self._loop.add_reader(
+                self.dev_sock.fileno(), self._handle_device_data)
+            target = args.device_interface
+        output_line(f"Emulated link ready: {args.interface} <-> {target}")
+        await asyncio.Event().wait()
+
+    def report(self) -> None:
+        self.monitor.report({
+            "host->device": self.to_device, "device->host": self.to_host
+        })
+
+    def close(self) -> None:
+        for sock in (self.host_sock, self.dev_sock):
+            if sock is not None:
+                self._loop.remove_reader(sock.fileno())
+                sock.close()
+        self.host_sock = self.dev_sock = None
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Katapult Link Impairment Emulator")
+    parser.add_argument(
+        "-d", "--device", metavar='<serial device>', default=None,
+        help="Serial device to proxy (stand-in device if omitted)"
+    )
+    parser.add_argument(
+        "-b", "--baud", type=int, default=250000, metavar='<baud rate>',
+        help="Serial baud rate of the proxied device"
+    )
+    parser.add_argument(
+        "-l", "--link", metavar='<path>', default=None,
+        help="Create a symlink to the emulated serial pty"
+    )
+    parser.add_argument(
+        "-i", "--interface", metavar='<can interface>', default=None,
+        help="Host side CAN interface (enables CAN mode)"
+    )
+    parser.add_argument(
+        "-D", "--device-interface", metavar='<can interface>', default=None,
+        help="Device side CAN interface (stand-in device if omitted)"
+    )
+    parser.add_argument(
+        "--frame-loss", type=float, default=0., metavar='<probability>',
+        help="Probability of dropping a CAN frame or serial chunk"
+    )
+    parser.add_argument(
+        "--byte-loss", type=float, default=0., metavar='<probability>',
+        help="Probability of dropping a single serial byte"
+    )
+    parser.add_argument(
+        "--ber", type=float, default=0., metavar='<probability>',
+        help="Serial bit error rate"
+    )
+    parser.add_argument(
+        "--reorder", type=float, default=0., metavar='<probability>',
+        help="Probability of delaying a unit behind later traffic"
+    )
+    parser.add_argument(
+        "--latency", type=float, default=0., metavar='<ms>',
+        help="Fixed one way latency in milliseconds"
+    )
+    parser.add_argument(
+        "--jitter", type=float, default=0., metavar='<ms>',
+        help="Maximum additional random latency in milliseconds"
+    )
+    parser.add_argument(
+        "--rate", type=int, default=0, metavar='<bits/s>',
+        help="Emulated line rate (0 for unlimited)"
+    )
+    parser.add_argument(
+        "--seed", type=int, default=None, metavar='<seed>',
+        help="Random seed for reproducible runs"
+    )
+    parser.add_argument(
+        "--block-size", type=int, default=64, metavar='<bytes>',
+        help="Stand-in device block size"
+    )
+    parser.add_argument(
+        "--start-address", type=lambda x: int(x, 0), default=0x8002000,
+        metavar='<address>', help="Stand-in device application address"
+    )
+    parser.add_argument(
+        "--service-time", type=float, default=0., metavar='<ms>',
+        help="Stand-in device processing time per command"
+    )
+    parser.add_argument(
+        "--standin-uuid", type=lambda x: int(x, 16), default=0x0123456789ab,
+        metavar='<uuid>', help="Stand-in device CAN uuid"
+    )
+    parser.add_argument(
+        "-v", "--verbose", action="store_true",
+        help="Enable verbose responses"
+    )
+
+    args = parser.parse_args()
+    if not args.verbose:
+        logging.getLogger().setLevel(logging.ERROR)
+    if args.block_size not in [64, 128, 256, 512]:
+        parser.error("Invalid Block Size: %d" % (args.block_size,))
+    signal.signal(signal.SIGTERM, handle_sigterm)
+    loop = asyncio.get_event_loop()
+    if args.interface is not None:
+        emu = CanEmulator(loop, args)
+    else:
+        emu = SerialEmulator(loop, args)
+    try:
+        loop.run_until_complete(emu.run())
+    except KeyboardInterrupt:
+        pass
+    except Exception:
+        logging.exception("Link Emulator Error")
+        sys.exit(-1)
+    finally:
+        emu.close()
+    emu.report()
+
+
+if __name__ == '__main__':
+    main()
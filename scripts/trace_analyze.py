@@ -0,0 +1,505 @@
+#!/usr/bin/env python3
+# Analyze a session trace recorded with "flashtool.py --trace"
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+from __future__ import annotations
+import sys
+import struct
+import argparse
+import pathlib
+from typing import Dict, List, Optional, Tuple
+
+TRACE_MAGIC = b"KTRC"
+TRACE_VERSION = 1
+TRACE_HEADER_FMT = "<4sBBI"
+TRACE_RECORD_FMT = "<BIIH"
+TRACE_TRANSPORT_CAN = 0
+TRACE_TRANSPORT_SERIAL = 1
+TRACE_DIR_TX = 0
+TRACE_DIR_RX = 1
+
+CAN_EFF_FLAG = 0x80000000
+CAN_EFF_MASK = 0x1FFFFFFF
+CANBUS_ID_ADMIN = 0x3f0
+CANBUS_ID_ADMIN_RESP = 0x3f1
+DEFAULT_CAN_BITRATE = 500000
+
+CMD_HEADER = b'\x01\x88'
+CMD_TRAILER = b'\x99\x03'
+COMMAND_NAMES = {
+    0x11: "CONNECT",
+    0x12: "SEND_BLOCK",
+    0x13: "SEND_EOF",
+    0x14: "REQUEST_BLOCK",
+    0x15: "COMPLETE",
+    0x16: "GET_CANBUS_ID",
+}
+ACK_SUCCESS = 0xa0
+
+def output_line(msg: str) -> None:
+    sys.stdout.write(msg + "\n")
+
+class TraceRecord:
+    def __init__(
+        self, direction: int, time: float, can_id: int, data: bytes
+    ) -> None:
+        self.direction = direction
+        self.time = time
+        self.can_id = can_id
+        self.data = data
+
+class Trace:
+    def __init__(self, path: pathlib.Path) -> None:
+        with open(path, "rb") as f:
+            raw = f.read()
+        hdr_size = struct.calcsize(TRACE_HEADER_FMT)
+        if len(raw) < hdr_size:
+            raise ValueError("Trace file too short")
+        magic, version, transport, bitrate = struct.unpack_from(
+            TRACE_HEADER_FMT, raw
+        )
+        if magic != TRACE_MAGIC or version != TRACE_VERSION:
+            raise ValueError("Not a Katapult trace file")
+        self.transport = transport
+        self.bitrate = bitrate
+        self.records: List[TraceRecord] = []
+        rec_size = struct.calcsize(TRACE_RECORD_FMT)
+        pos = hdr_size
+        last_usecs = wrap = 0
+        while pos + rec_size <= len(raw):
+            direction, usecs, can_id, length = struct.unpack_from(
+                TRACE_RECORD_FMT, raw, pos
+            )
+            pos += rec_size
+            data = raw[pos:pos + length]
+            pos += length
+            if len(data) < length:
+                # Truncated trace
+                break
+            # Timestamps are 32 bit microseconds, undo wraparound
+            if usecs < last_usecs:
+                wrap += 1 << 32
+            last_usecs = usecs
+            self.records.append(
+                TraceRecord(direction, (usecs + wrap) / 1000000., can_id, data)
+            )
+
+def can_frame_bits(length: int, extended: bool = False) -> int:
+    # Nominal bits on the bus from SOF through EOF plus the interframe
+    # space, excluding bit stuffing
+    return (67 if extended else 47) + 8 * length
+
+def uart_bits(length: int) -> int:
+    # 8N1 framing
+    return 10 * length
+
+class WireModel:
+    """Nominal time on the wire for each trace record"""
+    def __init__(
+        self, transport: int, bitrate: int, assumed: bool = False
+    ) -> None:
+        self.transport = transport
+        self.bitrate = bitrate
+        self.assumed = assumed
+
+    def frame_bits(self, rec: TraceRecord) -> int:
+        if self.transport == TRACE_TRANSPORT_CAN:
+            return can_frame_bits(len(rec.data),
+                                  bool(rec.can_id & CAN_EFF_FLAG))
+        return uart_bits(len(rec.data))
+
+    def stream_bits(self, length: int) -> int:
+        # Bits needed to carry a message of the given length
+        if self.transport == TRACE_TRANSPORT_CAN:
+            frames, remaining = divmod(length, 8)
+            bits = frames * can_frame_bits(8)
+            if remaining:
+                bits += can_frame_bits(remaining)
+            return bits
+        return uart_bits(length)
+
+    def duration(self, bits: int) -> float:
+        if not self.bitrate:
+            return 0.
+        return bits / float(self.bitrate)
+
+class Message:
+    """A complete Katapult command or response frame"""
+    def __init__(self, start: float, end: float, data: bytes,
+                 first: TraceRecord, last: TraceRecord) -> None:
+        self.start = start
+        self.end = end
+        self.data = data
+        self.first = first
+        self.last = last
+
+    @property
+    def code(self) -> int:
+        return self.data[2]
+
+    @property
+    def acked_cmd(self) -> int:
+        if len(self.data) < 8:
+            return 0
+        return self.data[4]
+
+class MessageAssembler:
+    def __init__(self) -> None:
+        self.buf = bytearray()
+        self.chunks: List[Tuple[int, TraceRecord]] = []
+        self.messages: List[Message] = []
+
+    def feed(self, rec: TraceRecord) -> None:
+        self.chunks.append((len(self.buf), rec))
+        self.buf.extend(rec.data)
+        while True:
+            idx = self.buf.find(CMD_HEADER)
+            if idx < 0:
+                self._discard(max(0, len(self.buf) - 1))
+                return
+            self._discard(idx)
+            if len(self.buf) < 4:
+                return
+            length = self.buf[3] * 4 + 8
+            if len(self.buf) < length:
+                return
+            if self.buf[length - 2:length] != CMD_TRAILER:
+                self._discard(1)
+                continue
+            first = self.chunks[0][1]
+            last = first
+            for offset, chunk in self.chunks:
+                if offset >= length:
+                    break
+                last = chunk
+            self.messages.append(Message(
+                first.time, last.time, bytes(self.buf[:length]), first, last
+            ))
+            self._discard(length)
+
+    def _discard(self, count: int) -> None:
+        if not count:
+            return
+        del self.buf[:count]
+        chunks = []
+        for offset, rec in self.chunks:
+            end = offset + len(rec.data)
+            if end > count:
+                chunks.append((max(0, offset - count), rec))
+        self.chunks = chunks
+
+class Exchange:
+    def __init__(self, cmd: Message, resp: Optional[Message]) -> None:
+        self.cmd = cmd
+        self.resp = resp
+        self.think: Optional[float] = None
+        self.service: Optional[float] = None
+        self.clamped = False
+
+    @property
+    def name(self) -> str:
+        return COMMAND_NAMES.get(self.cmd.code, "0x%02x" % (self.cmd.code,))
+
+def percentile(values: List[float], pct: float) -> float:
+    values = sorted(values)
+    idx = min(len(values) - 1, int(pct / 100. * len(values)))
+    return values[idx]
+
+def busy_time(intervals: List[Tuple[float, float]]) -> float:
+    total = 0.
+    cur_start = cur_end = None
+    for start, end in sorted(intervals):
+        if cur_end is None or start > cur_end:
+            if cur_end is not None:
+                total += cur_end - cur_start
+            cur_start, cur_end = start, end
+        else:
+            cur_end = max(cur_end, end)
+    if cur_end is not None:
+        total += cur_end - cur_start
+    return total
+
+def fmt_ms(val: float) -> str:
+    return "%8.3f" % (val * 1000.,)
+
+def fmt_rate(val: Optional[float]) -> str:
+    if val is None:
+        return "n/a"
+    return "%.1f KiB/s" % (val / 1024.,)
+
+class TraceAnalyzer:
+    def __init__(self, trace: Trace, wire: WireModel) -> None:
+        self.trace = trace
+        self.wire = wire
+        self.exchanges: List[Exchange] = []
+        self.stray_responses = 0
+        self.warnings: List[str] = []
+
+    def _is_session_record(self, rec: TraceRecord) -> bool:
+        if self.trace.transport != TRACE_TRANSPORT_CAN:
+            return True
+        can_id = rec.can_id & CAN_EFF_MASK
+        return can_id not in (CANBUS_ID_ADMIN, CANBUS_ID_ADMIN_RESP)
+
+    def _pair_messages(self) -> None:
+        tx = MessageAssembler()
+        rx = MessageAssembler()
+        for rec in self.trace.records:
+            if not self._is_session_record(rec):
+                continue
+            if rec.direction == TRACE_DIR_TX:
+                tx.feed(rec)
+            else:
+                rx.feed(rec)
+        commands = tx.messages
+        responses = rx.messages
+        ridx = 0
+        for i, cmd in enumerate(commands):
+            next_start = None
+            if i + 1 < len(commands):
+                next_start = commands[i + 1].start
+            # Responses that arrived before this command are strays
+            while ridx < len(responses) and responses[ridx].start < cmd.end:
+                self.stray_responses += 1
+                ridx += 1
+            resp = None
+            if ridx < len(responses):
+                cand = responses[ridx]
+                if next_start is None or cand.start <= next_start:
+                    resp = cand
+                    ridx += 1
+            exch = Exchange(cmd, resp)
+            if resp is not None and next_start is not None:
+                exch.think = max(0., next_start - resp.end)
+            self._calc_service_time(exch)
+            self.exchanges.append(exch)
+        self.stray_responses += len(responses) - ridx
+
+    def _calc_service_time(self, exch: Exchange) -> None:
+        # Time between the end of the command and the start of the
+        # response, less the wire time of the last command chunk and the
+        # first response chunk.
+        if exch.resp is None:
+            return
+        gap = exch.resp.start - exch.cmd.end
+        gap -= self.wire.duration(self.wire.frame_bits(exch.cmd.last))
+        gap -= self.wire.duration(self.wire.frame_bits(exch.resp.first))
+        # A response can not arrive before the wire time has elapsed,
+        # a negative gap means the wire model does not fit this trace
+        exch.clamped = gap < 0.
+        exch.service = max(0., gap)
+
+    def report_idle(self) -> None:
+        records = self.trace.records
+        span = records[-1].time - records[0].time
+        output_line("Session")
+        output_line("  Records:           %d" % (len(records),))
+        output_line("  Duration:          %.3f s" % (span,))
+        assumed = " (assumed)" if self.wire.assumed else ""
+        if not self.wire.bitrate:
+            output_line("  Transport:         %s (rate unknown, no wire model)"
+                        % ("CAN" if self.trace.transport
+                           == TRACE_TRANSPORT_CAN else "Serial",))
+        elif self.trace.transport == TRACE_TRANSPORT_CAN:
+            output_line("  Transport:         CAN @ %d bit/s%s"
+                        % (self.wire.bitrate, assumed))
+        else:
+            output_line("  Transport:         Serial @ %d baud%s"
+                        % (self.wire.bitrate, assumed))
+        if not self.wire.bitrate or span <= 0.:
+            output_line("  Bus idle:          n/a")
+            return
+        # Received data has finished arriving when it is recorded, sent
+        # data starts on the wire when it is recorded.
+        intervals = []
+        for rec in records:
+            dur = self.wire.duration(self.wire.frame_bits(rec))
+            if rec.direction == TRACE_DIR_RX:
+                intervals.append((rec.time - dur, rec.time))
+            else:
+                intervals.append((rec.time, rec.time + dur))
+        busy = min(span, busy_time(intervals))
+        output_line("  Bus busy:          %.3f s" % (busy,))
+        output_line("  Bus idle:          %.1f%%"
+                    % ((1. - busy / span) * 100.,))
+
+    def report_commands(self) -> None:
+        output_line("")
+        output_line("Per-command timing (ms)")
+        output_line("  %-14s %6s %6s %8s %8s %8s %8s %8s"
+                    % ("command", "count", "lost", "svc avg", "svc p50",
+                       "svc p95", "svc max", "rtt avg"))
+        by_name: Dict[str, List[Exchange]] = {}
+        for exch in self.exchanges:
+            by_name.setdefault(exch.name, []).append(exch)
+        for name, exchs in by_name.items():
+            svc_vals = [e.service for e in exchs if e.service is not None]
+            rtt = [e.resp.end - e.cmd.start for e in exchs
+                   if e.resp is not None]
+            lost = len(exchs) - len(svc_vals)
+            if not svc_vals:
+                output_line("  %-14s %6d %6d" % (name, len(exchs), lost))
+                continue
+            output_line(
+                "  %-14s %6d %6d %s %s %s %s %s"
+                % (name, len(exchs), lost,
+                   fmt_ms(sum(svc_vals) / len(svc_vals)),
+                   fmt_ms(percentile(svc_vals, 50)),
+                   fmt_ms(percentile(svc_vals, 95)),
+                   fmt_ms(max(svc_vals)), fmt_ms(sum(rtt) / len(rtt)))
+            )
+        if self.stray_responses:
+            output_line("  Unmatched responses: %d"
+                        % (self.stray_responses,))
+
+    def report_breakdown(self) -> None:
+        send = wire = service = receive = think = lost = 0.
+        for i, exch in enumerate(self.exchanges):
+            send += exch.cmd.end - exch.cmd.start
+            if exch.resp is None:
+                # Host waited for a response that never came
+                if i + 1 < len(self.exchanges):
+                    lost += self.exchanges[i + 1].cmd.start - exch.cmd.end
+                continue
+            svc = exch.service
+            service += svc
+            wire += exch.resp.start - exch.cmd.end - svc
+            receive += exch.resp.end - exch.resp.start
+            if exch.think is not None:
+                think += exch.think
+        total = send + wire + service + receive + think + lost
+        if total <= 0.:
+            return
+        output_line("")
+        output_line("Round trip breakdown")
+        for label, val in (
+            ("Host send", send), ("Wire latency", wire),
+            ("Device service", service), ("Host receive", receive),
+            ("Host think", think), ("Timeout wait", lost)
+        ):
+            output_line("  %-17s %10.3f s  %5.1f%%"
+                        % (label + ":", val, val / total * 100.))
+
+    def _phase_rate(self, name: str, is_write: bool) -> None:
+        exchs = [e for e in self.exchanges if e.name == name]
+        acked = [e for e in exchs if e.resp is not None
+                 and e.resp.code == ACK_SUCCESS
+                 and e.resp.acked_cmd == e.cmd.code]
+        if not acked:
+            return
+        blocks: Dict[int, int] = {}
+        for exch in acked:
+            if is_write:
+                addr, = struct.unpack_from("<I", exch.cmd.data, 4)
+                size = len(exch.cmd.data) - 12
+            else:
+                addr, = struct.unpack_from("<I", exch.resp.data, 8)
+                size = len(exch.resp.data) - 16
+            blocks[addr] = size
+        payload = sum(blocks.values())
+        elapsed = acked[-1].resp.end - exchs[0].cmd.start
+        effective = payload / elapsed if elapsed > 0. else None
+        # Theoretical limits derived from the observed frame sizes
+        block_size = max(blocks.values())
+        cmd_len = max(len(e.cmd.data) for e in acked)
+        resp_len = max(len(e.resp.data) for e in acked)
+        stop_wait = streaming = None
+        if self.wire.bitrate:
+            cmd_bits = self.wire.stream_bits(cmd_len)
+            resp_bits = self.wire.stream_bits(resp_len)
+            stop_wait = block_size / self.wire.duration(cmd_bits + resp_bits)
+            if is_write:
+                streaming = block_size / self.wire.duration(cmd_bits)
+            else:
+                streaming = block_size / self.wire.duration(resp_bits)
+        output_line("  %s:" % (name,))
+        output_line("    Unique blocks:       %d (%d bytes)"
+                    % (len(blocks), payload))
+        output_line("    Effective:           %s" % (fmt_rate(effective),))
+        output_line("    Line limit (ack):    %s" % (fmt_rate(stop_wait),))
+        output_line("    Line limit (stream): %s" % (fmt_rate(streaming),))
+        if effective is None or not stop_wait:
+            return
+        if effective > stop_wait:
+            output_line("    Efficiency:          n/a (exceeds line limit)")
+            self.warnings.append(
+                "%s effective rate %s exceeds the %s line limit of the wire "
+                "model" % (name, fmt_rate(effective), fmt_rate(stop_wait)))
+            return
+        output_line("    Efficiency:          %.1f%%"
+                    % (effective / stop_wait * 100.,))
+
+    def report_throughput(self) -> None:
+        output_line("")
+        output_line("Throughput")
+        self._phase_rate("SEND_BLOCK", True)
+        self._phase_rate("REQUEST_BLOCK", False)
+
+    def report_warnings(self) -> None:
+        warnings = []
+        if self.wire.assumed:
+            warnings.append(
+                "The trace does not record the bitrate, %d bit/s was"
+                " assumed. Use -b <bitrate> to set the real rate."
+                % (self.wire.bitrate,))
+        clamped = len([e for e in self.exchanges if e.clamped])
+        if clamped:
+            answered = len([e for e in self.exchanges if e.resp is not None])
+            self.warnings.append(
+                "%d of %d responses arrived sooner than the wire model"
+                " allows, their service time was reported as 0"
+                % (clamped, answered))
+        if self.warnings:
+            # Results contradict the wire model
+            warnings += self.warnings
+            warnings.append(
+                "The bitrate is wrong or the link is not a UART or CAN bus"
+                " (eg USB), use -b 0 to disable the wire model")
+        if not warnings:
+            return
+        output_line("")
+        output_line("Warnings")
+        for msg in warnings:
+            output_line("  " + msg)
+
+    def run(self) -> None:
+        if not self.trace.records:
+            output_line("Trace contains no records")
+            return
+        self._pair_messages()
+        self.report_idle()
+        self.report_commands()
+        self.report_breakdown()
+        self.report_throughput()
+        self.report_warnings()
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Katapult Session Trace Analyzer")
+    parser.add_argument(
+        "trace", metavar="<trace file>",
+        help="Trace file recorded with flashtool.py --trace"
+    )
+    parser.add_argument(
+        "-b", "--bitrate", metavar="<bitrate>", type=int, default=None,
+        help="Override the bitrate stored in the trace (0 disables the "
+             "wire time model, eg for USB)"
+    )
+    args = parser.parse_args()
+    try:
+        trace = Trace(pathlib.Path(args.trace).expanduser())
+    except (OSError, ValueError) as e:
+        sys.stderr.write("Unable to load trace: %s\n" % (e,))
+        sys.exit(-1)
+    bitrate = args.bitrate
+    assumed = False
+    if bitrate is None:
+        bitrate = trace.bitrate
+        if not bitrate and trace.transport == TRACE_TRANSPORT_CAN:
+            bitrate = DEFAULT_CAN_BITRATE
+            assumed = True
+    wire = WireModel(trace.transport, bitrate, assumed)
+    TraceAnalyzer(trace, wire).run()
+
+if __name__ == '__main__':
+    main()
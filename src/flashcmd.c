@@ -36,13 +36,20 @@ command_connect(uint32_t *data)
 static uint8_t complete;
 static uint32_t complete_endtime;
 
+// Start the application after a short delay
+void
+flashcmd_complete(void)
+{
+    complete = 1;
+    complete_endtime = timer_read_time() + timer_from_us(100000);
+}
+
 void
 command_complete(uint32_t *data)
 {
     uint32_t out[3];
     command_respond_ack(CMD_COMPLETE, out, ARRAY_SIZE(out));
-    complete = 1;
-    complete_endtime = timer_read_time() + timer_from_us(100000);
+    flashcmd_complete();
 }
 
 void
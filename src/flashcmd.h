@@ -1,6 +1,7 @@
 #ifndef __FLASHCMD_H
 #define __FLASHCMD_H
 
+void flashcmd_complete(void);
 int flashcmd_is_in_transfer(void);
 
 #endif // flashcmd.h
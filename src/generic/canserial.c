@@ -117,6 +117,7 @@ console_sendf(const struct command_encoder *ce, va_list args)
 #define CANBUS_CMD_SET_CANBOOT_NODEID 0x11
 #define CANBUS_CMD_CLEAR_CANBOOT_NODEID 0x12
 #define CANBUS_RESP_NEED_NODEID 0x20
+#define CANBUS_RESP_CANBOOT_NODEID_SET 0x21
 
 // Helper to verify a UUID in a command matches this chip's UUID
 static int
@@ -165,6 +166,25 @@ can_process_query_unassigned(struct canbus_msg *msg)
     }
 }
 
+// Acknowledge a node id assignment so the host can pipeline assignments
+static void
+can_send_nodeid_set(uint8_t nodeid)
+{
+    struct canbus_msg send;
+    send.id = CANBUS_ID_ADMIN_RESP;
+    send.dlc = 8;
+    send.data[0] = CANBUS_RESP_CANBOOT_NODEID_SET;
+    memcpy(&send.data[1], CanData.uuid, sizeof(CanData.uuid));
+    send.data[7] = nodeid;
+
+    // Send with retry
+    for (;;) {
+        int ret = canbus_send(&send);
+        if (ret >= 0)
+            return;
+    }
+}
+
 static void
 can_process_clear_canboot_nodeid(void)
 {
@@ -190,6 +210,7 @@ can_process_set_canboot_nodeid(struct canbus_msg *msg)
             CanData.assigned_id = newid;
             canbus_set_filter(CanData.assigned_id);
         }
+        can_send_nodeid_set(msg->data[7]);
     } else if (newid == CanData.assigned_id) {
         can_id_conflict();
     }
@@ -21,12 +21,15 @@ int_fast8_t usb_send_ep0_progmem(const void *data, uint_fast8_t len);
 void usb_stall_ep0(void);
 void usb_set_address(uint_fast8_t addr);
 void usb_set_configure(void);
+void usb_reset_bulk_toggle(uint_fast8_t ep);
 struct usb_string_descriptor *usbserial_get_serialid(void);
 
 // usb_cdc.c
-void usb_fill_serial(struct usb_string_descriptor *desc, int strlen, void *id);
 void usb_notify_bulk_in(void);
 void usb_notify_bulk_out(void);
+
+// usb_ep0.c
+void usb_fill_serial(struct usb_string_descriptor *desc, int strlen, void *id);
 void usb_notify_ep0(void);
 
 #endif // usb_cdc.h
@@ -0,0 +1,36 @@
+#ifndef __GENERIC_USB_EP0_H
+#define __GENERIC_USB_EP0_H
+
+#include <stdint.h> // uint_fast8_t
+
+struct usb_ctrlrequest;
+
+// String descriptor ids
+enum {
+    USB_STR_ID_MANUFACTURER = 1, USB_STR_ID_PRODUCT, USB_STR_ID_SERIAL,
+};
+
+// Transfer flags for usb_do_xfer()
+enum {
+    UX_READ = 1<<0, UX_SEND = 1<<1, UX_SEND_PROGMEM = 1<<2, UX_SEND_ZLP = 1<<3
+};
+
+// Entry in a descriptor lookup table
+struct descriptor_s {
+    uint_fast16_t wValue;
+    uint_fast16_t wIndex;
+    const void *desc;
+    uint_fast8_t size;
+};
+
+// usb_ep0.c
+void usb_do_stall(void);
+void usb_do_xfer(void *data, uint_fast8_t size, uint_fast8_t flags);
+
+// callbacks provided by the usb class code (usb_cdc.c or usb_msc.c)
+extern const struct descriptor_s usb_class_descriptors[];
+extern const uint8_t usb_class_descriptors_count;
+void usb_class_configure(void);
+void usb_class_request(struct usb_ctrlrequest *req);
+
+#endif // usb_ep0.h
@@ -0,0 +1,680 @@
+// Support for UF2 flashing via a USB mass storage device
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_USB_VENDOR_ID
+#include "board/flash.h" // flash_write_block
+#include "board/misc.h" // console_sendf
+#include "board/pgm.h" // PROGMEM
+#include "board/usb_cdc_ep.h" // USB_CDC_EP_BULK_IN
+#include "byteorder.h" // cpu_to_le16
+#include "command.h" // DECL_CONSTANT
+#include "flashcmd.h" // flashcmd_complete
+#include "generic/usbstd.h" // struct usb_device_descriptor
+#include "generic/usbstd_msc.h" // struct usb_msc_cbw
+#include "sched.h" // sched_wake_task
+#include "usb_cdc.h" // usb_notify_ep0
+#include "usb_ep0.h" // usb_do_xfer
+
+// The framed command protocol is not available in mass storage mode
+void
+console_sendf(const struct command_encoder *ce, va_list args)
+{
+}
+
+
+/****************************************************************
+ * Emulated FAT16 volume
+ ****************************************************************/
+
+#define MSC_SECTOR_SIZE 512
+#define FAT_NUM_SECTORS 8000
+#define FAT_ROOT_ENTRIES 64
+#define FAT_SECTORS_PER_FAT DIV_ROUND_UP(FAT_NUM_SECTORS * 2             \
+                                         , MSC_SECTOR_SIZE)
+#define FAT_START 1
+#define FAT_ROOT_START (FAT_START + 2 * FAT_SECTORS_PER_FAT)
+#define FAT_DATA_START (FAT_ROOT_START                                  \
+                        + FAT_ROOT_ENTRIES * 32 / MSC_SECTOR_SIZE)
+#define FAT_VOLUME_LABEL "KATAPULT   "
+
+struct fat_boot_sector {
+    uint8_t jump[3];
+    uint8_t oem_name[8];
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint8_t num_fats;
+    uint16_t root_entries;
+    uint16_t total_sectors16;
+    uint8_t media;
+    uint16_t sectors_per_fat;
+    uint16_t sectors_per_track;
+    uint16_t num_heads;
+    uint32_t hidden_sectors;
+    uint32_t total_sectors32;
+    uint8_t drive_number;
+    uint8_t reserved;
+    uint8_t boot_signature;
+    uint32_t volume_id;
+    uint8_t volume_label[11];
+    uint8_t fs_type[8];
+} PACKED;
+
+struct fat_dir_entry {
+    uint8_t name[11];
+    uint8_t attrs;
+    uint8_t reserved;
+    uint8_t create_time_fine;
+    uint16_t create_time;
+    uint16_t create_date;
+    uint16_t last_access_date;
+    uint16_t cluster_high;
+    uint16_t update_time;
+    uint16_t update_date;
+    uint16_t cluster_low;
+    uint32_t size;
+} PACKED;
+
+static const struct fat_boot_sector fat_boot_sector = {
+    .jump = { 0xeb, 0x3c, 0x90 },
+    .oem_name = "KATAPULT",
+    .bytes_per_sector = cpu_to_le16(MSC_SECTOR_SIZE),
+    .sectors_per_cluster = 1,
+    .reserved_sectors = cpu_to_le16(FAT_START),
+    .num_fats = 2,
+    .root_entries = cpu_to_le16(FAT_ROOT_ENTRIES),
+    .total_sectors16 = cpu_to_le16(FAT_NUM_SECTORS),
+    .media = 0xf8,
+    .sectors_per_fat = cpu_to_le16(FAT_SECTORS_PER_FAT),
+    .sectors_per_track = cpu_to_le16(1),
+    .num_heads = cpu_to_le16(1),
+    .drive_number = 0x80,
+    .boot_signature = 0x29,
+    .volume_id = cpu_to_le32(0x00420042),
+    .volume_label = FAT_VOLUME_LABEL,
+    .fs_type = "FAT16   ",
+};
+
+static const uint8_t fat_boot_magic[] = { 0x55, 0xaa };
+
+// Media descriptor, reserved entry, and end of chain for the info file
+static const uint8_t fat_table_start[] = {
+    0xf8, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static const char info_uf2_txt[] =
+    "Katapult UF2 Bootloader\r\n"
+    "Model: " CONFIG_MCU "\r\n"
+    "Board-ID: Katapult-" CONFIG_MCU "\r\n"
+    "Application Address: " __stringify(CONFIG_LAUNCH_APP_ADDRESS) "\r\n";
+
+static const struct fat_dir_entry fat_root_dir[] = {
+    {
+        .name = FAT_VOLUME_LABEL,
+        .attrs = 0x08,
+    }, {
+        .name = "INFO_UF2TXT",
+        .attrs = 0x01,
+        .cluster_low = cpu_to_le16(2),
+        .size = cpu_to_le32(sizeof(info_uf2_txt) - 1),
+    },
+};
+
+// Copy the part of 'src' (located at 'src_pos' in a sector) that
+// overlaps the sector range [offset, offset+len) into 'buf'
+static void
+fat_fill(uint8_t *buf, uint32_t offset, uint32_t len
+         , const void *src, uint32_t src_pos, uint32_t src_len)
+{
+    uint32_t start = offset > src_pos ? offset : src_pos;
+    uint32_t end = offset + len, src_end = src_pos + src_len;
+    if (end > src_end)
+        end = src_end;
+    if (start >= end)
+        return;
+    memcpy(&buf[start - offset], src + start - src_pos, end - start);
+}
+
+// Generate part of a sector of the emulated volume
+static void
+fat_read(uint32_t lba, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    memset(buf, 0, len);
+    if (lba == 0) {
+        fat_fill(buf, offset, len, &fat_boot_sector, 0
+                 , sizeof(fat_boot_sector));
+        fat_fill(buf, offset, len, fat_boot_magic, MSC_SECTOR_SIZE - 2
+                 , sizeof(fat_boot_magic));
+    } else if (lba == FAT_START || lba == FAT_START + FAT_SECTORS_PER_FAT) {
+        fat_fill(buf, offset, len, fat_table_start, 0
+                 , sizeof(fat_table_start));
+    } else if (lba == FAT_ROOT_START) {
+        fat_fill(buf, offset, len, fat_root_dir, 0, sizeof(fat_root_dir));
+    } else if (lba == FAT_DATA_START) {
+        fat_fill(buf, offset, len, info_uf2_txt, 0
+                 , sizeof(info_uf2_txt) - 1);
+    }
+}
+
+
+/****************************************************************
+ * UF2 block flashing
+ ****************************************************************/
+
+#define UF2_MAGIC_START0 0x0A324655
+#define UF2_MAGIC_START1 0x9E5D5157
+#define UF2_MAGIC_END 0x0AB16F30
+#define UF2_FLAG_NOT_MAIN_FLASH 0x00000001
+#define UF2_MAX_PAYLOAD 476
+#define UF2_MAX_BLOCKS (CONFIG_RAM_SIZE >= 0x10000 ? 8192 : 2048)
+
+// The lpc176x flash code gathers blocks into 256 byte IAP writes and only
+// accepts a jump in address at a 256 byte boundary
+#if CONFIG_MACH_LPC176X && CONFIG_BLOCK_SIZE < 256
+#define UF2_ALIGN 256
+#else
+#define UF2_ALIGN CONFIG_BLOCK_SIZE
+#endif
+
+struct uf2_block {
+    uint32_t magic_start0;
+    uint32_t magic_start1;
+    uint32_t flags;
+    uint32_t target_addr;
+    uint32_t payload_size;
+    uint32_t block_no;
+    uint32_t num_blocks;
+    uint32_t file_size;
+    uint32_t data[UF2_MAX_PAYLOAD / 4];
+    uint32_t magic_end;
+};
+
+static struct {
+    uint32_t num_blocks, written, start, end;
+    uint8_t seen[UF2_MAX_BLOCKS / 8];
+} UF2;
+
+// Write the payload of a main flash UF2 block
+static int
+uf2_write_main(uint32_t addr, uint32_t size, uint32_t block_no, uint32_t *data)
+{
+    if (!size || size > UF2_MAX_PAYLOAD || size & (UF2_ALIGN - 1)
+        || addr & (UF2_ALIGN - 1) || addr < CONFIG_LAUNCH_APP_ADDRESS)
+        return -1;
+    if (!UF2.end) {
+        // First block of a new image - erase the flash it covers
+        uint32_t offset = block_no * size, base = CONFIG_LAUNCH_APP_ADDRESS;
+        if (addr - CONFIG_LAUNCH_APP_ADDRESS > offset)
+            base = addr - offset;
+        uint32_t end = addr + (UF2.num_blocks - block_no) * size;
+        int ret = flash_prepare_range(base, end);
+        if (ret < 0)
+            return ret;
+        UF2.start = base;
+        UF2.end = end;
+    }
+    if (addr < UF2.start || addr >= UF2.end || size > UF2.end - addr)
+        // Block outside of the erased range
+        return -1;
+    uint32_t pos;
+    for (pos = 0; pos < size; pos += CONFIG_BLOCK_SIZE) {
+        int ret = flash_write_block(addr + pos, &data[pos / 4]);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+// Write a UF2 block to flash (blocks may arrive in any order)
+static int
+uf2_write_block(struct uf2_block *b)
+{
+    if (le32_to_cpu(b->magic_start0) != UF2_MAGIC_START0
+        || le32_to_cpu(b->magic_start1) != UF2_MAGIC_START1
+        || le32_to_cpu(b->magic_end) != UF2_MAGIC_END)
+        // Not a UF2 block (directory and FAT updates land here too)
+        return 0;
+    uint32_t flags = le32_to_cpu(b->flags);
+    uint32_t addr = le32_to_cpu(b->target_addr);
+    uint32_t size = le32_to_cpu(b->payload_size);
+    uint32_t block_no = le32_to_cpu(b->block_no);
+    uint32_t num_blocks = le32_to_cpu(b->num_blocks);
+    if (!num_blocks || num_blocks > UF2_MAX_BLOCKS || block_no >= num_blocks
+        || (UF2.num_blocks && num_blocks != UF2.num_blocks))
+        return -1;
+    UF2.num_blocks = num_blocks;
+    uint8_t bit = 1 << (block_no & 7), *seen = &UF2.seen[block_no / 8];
+    if (*seen & bit)
+        // Block rewritten by host
+        return 0;
+    if (!(flags & UF2_FLAG_NOT_MAIN_FLASH)) {
+        int ret = uf2_write_main(addr, size, block_no, b->data);
+        if (ret < 0)
+            return ret;
+    }
+    // Blocks not destined for main flash still count towards num_blocks
+    *seen |= bit;
+    if (++UF2.written >= UF2.num_blocks && UF2.end) {
+        // Image complete - start the application shortly
+        int ret = flash_complete();
+        if (ret < 0)
+            return ret;
+        flashcmd_complete();
+    }
+    return 0;
+}
+
+
+/****************************************************************
+ * SCSI command handling
+ ****************************************************************/
+
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE 0x03
+#define SCSI_INQUIRY 0x12
+#define SCSI_MODE_SENSE6 0x1a
+#define SCSI_START_STOP_UNIT 0x1b
+#define SCSI_PREVENT_ALLOW_REMOVAL 0x1e
+#define SCSI_READ_FORMAT_CAPACITIES 0x23
+#define SCSI_READ_CAPACITY10 0x25
+#define SCSI_READ10 0x28
+#define SCSI_WRITE10 0x2a
+#define SCSI_VERIFY10 0x2f
+#define SCSI_MODE_SENSE10 0x5a
+
+#define SENSE_ILLEGAL_REQUEST 0x05
+#define SENSE_MEDIUM_ERROR 0x03
+#define ASC_INVALID_COMMAND 0x20
+#define ASC_LBA_OUT_OF_RANGE 0x21
+#define ASC_WRITE_FAULT 0x03
+
+enum { MS_CBW, MS_DATA_IN, MS_DATA_OUT, MS_CSW };
+
+static struct {
+    struct usb_msc_cbw cbw;
+    uint32_t xfer_pos, xfer_len, data_len, lba;
+    uint8_t state, status, sense_key, asc;
+    uint8_t resp[36];
+} MSC;
+
+static uint8_t sector_buf[MSC_SECTOR_SIZE + USB_CDC_EP_BULK_OUT_SIZE]
+    __aligned(4);
+
+static void
+msc_fail(uint8_t sense_key, uint8_t asc)
+{
+    MSC.status = USB_MSC_CSW_FAILED;
+    MSC.sense_key = sense_key;
+    MSC.asc = asc;
+}
+
+static void
+msc_put_be32(uint8_t *p, uint32_t v)
+{
+    v = cpu_to_be32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static const uint8_t inquiry_resp[36] = {
+    0x00, 0x80, 0x02, 0x02, 31, 0x00, 0x00, 0x00,
+    'K', 'a', 't', 'a', 'p', 'u', 'l', 't',
+    'U', 'F', '2', ' ', 'B', 'o', 'o', 't',
+    'l', 'o', 'a', 'd', 'e', 'r', ' ', ' ',
+    '1', '.', '0', ' ',
+};
+
+// Set up the response (and expected data phase) for a command block
+static void
+msc_process_command(void)
+{
+    uint8_t *cb = MSC.cbw.CBWCB, *resp = MSC.resp;
+    uint32_t count;
+    MSC.status = USB_MSC_CSW_PASSED;
+    MSC.data_len = 0;
+    memset(resp, 0, sizeof(MSC.resp));
+    switch (cb[0]) {
+    case SCSI_TEST_UNIT_READY:
+    case SCSI_START_STOP_UNIT:
+    case SCSI_PREVENT_ALLOW_REMOVAL:
+    case SCSI_VERIFY10:
+        break;
+    case SCSI_INQUIRY:
+        memcpy(resp, inquiry_resp, sizeof(inquiry_resp));
+        MSC.data_len = sizeof(inquiry_resp);
+        break;
+    case SCSI_REQUEST_SENSE:
+        resp[0] = 0x70;
+        resp[2] = MSC.sense_key;
+        resp[7] = 10;
+        resp[12] = MSC.asc;
+        MSC.sense_key = MSC.asc = 0;
+        MSC.data_len = 18;
+        break;
+    case SCSI_MODE_SENSE6:
+        resp[0] = 3;
+        MSC.data_len = 4;
+        break;
+    case SCSI_MODE_SENSE10:
+        resp[1] = 6;
+        MSC.data_len = 8;
+        break;
+    case SCSI_READ_FORMAT_CAPACITIES:
+        resp[3] = 8;
+        msc_put_be32(&resp[4], FAT_NUM_SECTORS);
+        msc_put_be32(&resp[8], MSC_SECTOR_SIZE);
+        resp[8] = 0x02; // Formatted media
+        MSC.data_len = 12;
+        break;
+    case SCSI_READ_CAPACITY10:
+        msc_put_be32(&resp[0], FAT_NUM_SECTORS - 1);
+        msc_put_be32(&resp[4], MSC_SECTOR_SIZE);
+        MSC.data_len = 8;
+        break;
+    case SCSI_READ10:
+    case SCSI_WRITE10:
+        MSC.lba = (cb[2] << 24) | (cb[3] << 16) | (cb[4] << 8) | cb[5];
+        count = (cb[7] << 8) | cb[8];
+        if (MSC.lba + count > FAT_NUM_SECTORS) {
+            msc_fail(SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+            break;
+        }
+        MSC.data_len = count * MSC_SECTOR_SIZE;
+        break;
+    default:
+        msc_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+        break;
+    }
+
+    MSC.xfer_pos = 0;
+    MSC.xfer_len = le32_to_cpu(MSC.cbw.dCBWDataTransferLength);
+    int is_in = MSC.cbw.bmCBWFlags & USB_MSC_CBW_DIR_IN;
+    int is_rw = cb[0] == SCSI_READ10 || cb[0] == SCSI_WRITE10;
+    if (MSC.data_len > MSC.xfer_len && !is_rw)
+        // Host requested a truncated response
+        MSC.data_len = MSC.xfer_len;
+    if (MSC.data_len && (!!is_in != (cb[0] != SCSI_WRITE10)
+                         || MSC.data_len > MSC.xfer_len)) {
+        // Host and device disagree on the data phase
+        MSC.status = USB_MSC_CSW_PHASE_ERROR;
+        MSC.data_len = 0;
+    }
+    if (!MSC.xfer_len)
+        MSC.state = MS_CSW;
+    else
+        MSC.state = is_in ? MS_DATA_IN : MS_DATA_OUT;
+}
+
+// Generate the next packet of an in transfer (padded with zeros)
+static void
+msc_fill_in(uint8_t *buf, uint32_t len)
+{
+    uint32_t pos = MSC.xfer_pos;
+    if (pos >= MSC.data_len) {
+        memset(buf, 0, len);
+    } else if (MSC.cbw.CBWCB[0] == SCSI_READ10) {
+        fat_read(MSC.lba + pos / MSC_SECTOR_SIZE, pos % MSC_SECTOR_SIZE
+                 , buf, len);
+    } else {
+        memset(buf, 0, len);
+        fat_fill(buf, pos, len, MSC.resp, 0, MSC.data_len);
+    }
+}
+
+// Process a completely received sector of an out transfer
+static void
+msc_write_sector(void)
+{
+    if (MSC.status != USB_MSC_CSW_PASSED)
+        return;
+    int ret = uf2_write_block((void*)sector_buf);
+    if (ret < 0)
+        msc_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_FAULT);
+}
+
+
+/****************************************************************
+ * Bulk-only transport
+ ****************************************************************/
+
+static struct task_wake usb_msc_wake;
+
+void
+usb_notify_bulk_in(void)
+{
+    sched_wake_task(&usb_msc_wake);
+}
+
+void
+usb_notify_bulk_out(void)
+{
+    sched_wake_task(&usb_msc_wake);
+}
+
+static int
+msc_read_cbw(void)
+{
+    int_fast8_t ret = usb_read_bulk_out(sector_buf, USB_CDC_EP_BULK_OUT_SIZE);
+    if (ret < 0)
+        return -1;
+    struct usb_msc_cbw *cbw = (void*)sector_buf;
+    if (ret != sizeof(*cbw)
+        || le32_to_cpu(cbw->dCBWSignature) != USB_MSC_CBW_SIGNATURE)
+        // Invalid command block - ignore it
+        return 0;
+    memcpy(&MSC.cbw, cbw, sizeof(MSC.cbw));
+    msc_process_command();
+    return 0;
+}
+
+static int
+msc_send_data(void)
+{
+    uint32_t avail = MSC.xfer_len - MSC.xfer_pos;
+    uint_fast8_t len = (avail > USB_CDC_EP_BULK_IN_SIZE
+                        ? USB_CDC_EP_BULK_IN_SIZE : avail);
+    uint8_t buf[USB_CDC_EP_BULK_IN_SIZE];
+    msc_fill_in(buf, len);
+    int_fast8_t ret = usb_send_bulk_in(buf, len);
+    if (ret <= 0)
+        return -1;
+    MSC.xfer_pos += ret;
+    if (MSC.xfer_pos >= MSC.xfer_len)
+        MSC.state = MS_CSW;
+    return 0;
+}
+
+static int
+msc_recv_data(void)
+{
+    uint32_t pos = MSC.xfer_pos, spos = pos % MSC_SECTOR_SIZE;
+    int_fast8_t ret = usb_read_bulk_out(&sector_buf[spos]
+                                        , USB_CDC_EP_BULK_OUT_SIZE);
+    if (ret < 0)
+        return -1;
+    MSC.xfer_pos = pos + ret;
+    if (MSC.cbw.CBWCB[0] == SCSI_WRITE10 && pos < MSC.data_len
+        && spos + ret >= MSC_SECTOR_SIZE) {
+        msc_write_sector();
+        uint32_t extra = spos + ret - MSC_SECTOR_SIZE;
+        memmove(sector_buf, &sector_buf[MSC_SECTOR_SIZE], extra);
+    }
+    if (MSC.xfer_pos >= MSC.xfer_len || ret < USB_CDC_EP_BULK_OUT_SIZE)
+        MSC.state = MS_CSW;
+    return 0;
+}
+
+static int
+msc_send_csw(void)
+{
+    struct usb_msc_csw csw = {
+        .dCSWSignature = cpu_to_le32(USB_MSC_CSW_SIGNATURE),
+        .dCSWTag = MSC.cbw.dCBWTag,
+        .dCSWDataResidue = cpu_to_le32(MSC.xfer_len - MSC.data_len),
+        .bCSWStatus = MSC.status,
+    };
+    if (MSC.data_len > MSC.xfer_pos)
+        csw.dCSWDataResidue = cpu_to_le32(MSC.xfer_len - MSC.xfer_pos);
+    int_fast8_t ret = usb_send_bulk_in(&csw, sizeof(csw));
+    if (ret <= 0)
+        return -1;
+    MSC.state = MS_CBW;
+    return 0;
+}
+
+void
+usb_msc_task(void)
+{
+    if (!sched_check_wake(&usb_msc_wake))
+        return;
+    for (;;) {
+        int ret;
+        switch (MSC.state) {
+        case MS_CBW: ret = msc_read_cbw(); break;
+        case MS_DATA_IN: ret = msc_send_data(); break;
+        case MS_DATA_OUT: ret = msc_recv_data(); break;
+        default: ret = msc_send_csw(); break;
+        }
+        if (ret < 0)
+            // Hardware will notify when the endpoint is ready
+            return;
+    }
+}
+DECL_TASK(usb_msc_task);
+
+
+/****************************************************************
+ * USB descriptors
+ ****************************************************************/
+
+// Device descriptor
+static const struct usb_device_descriptor msc_device_descriptor PROGMEM = {
+    .bLength = sizeof(msc_device_descriptor),
+    .bDescriptorType = USB_DT_DEVICE,
+    .bcdUSB = cpu_to_le16(0x0200),
+    .bDeviceClass = USB_CLASS_PER_INTERFACE,
+    .bMaxPacketSize0 = USB_CDC_EP0_SIZE,
+    .idVendor = cpu_to_le16(CONFIG_USB_VENDOR_ID),
+    .idProduct = cpu_to_le16(CONFIG_USB_DEVICE_ID),
+    .bcdDevice = cpu_to_le16(0x0100),
+    .iManufacturer = USB_STR_ID_MANUFACTURER,
+    .iProduct = USB_STR_ID_PRODUCT,
+    .iSerialNumber = USB_STR_ID_SERIAL,
+    .bNumConfigurations = 1,
+};
+
+// Config descriptor
+static const struct config_s {
+    struct usb_config_descriptor config;
+    struct usb_interface_descriptor iface0;
+    struct usb_endpoint_descriptor ep1;
+    struct usb_endpoint_descriptor ep2;
+} PACKED msc_config_descriptor PROGMEM = {
+    .config = {
+        .bLength = sizeof(msc_config_descriptor.config),
+        .bDescriptorType = USB_DT_CONFIG,
+        .wTotalLength = cpu_to_le16(sizeof(msc_config_descriptor)),
+        .bNumInterfaces = 1,
+        .bConfigurationValue = 1,
+        .bmAttributes = 0xC0,
+        .bMaxPower = 50,
+    },
+    .iface0 = {
+        .bLength = sizeof(msc_config_descriptor.iface0),
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = 0,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = USB_CLASS_MASS_STORAGE,
+        .bInterfaceSubClass = USB_MSC_SUBCLASS_SCSI,
+        .bInterfaceProtocol = USB_MSC_PROTO_BULK_ONLY,
+    },
+    .ep1 = {
+        .bLength = sizeof(msc_config_descriptor.ep1),
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_CDC_EP_BULK_OUT,
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize = cpu_to_le16(USB_CDC_EP_BULK_OUT_SIZE),
+    },
+    .ep2 = {
+        .bLength = sizeof(msc_config_descriptor.ep2),
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = USB_CDC_EP_BULK_IN | USB_DIR_IN,
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize = cpu_to_le16(USB_CDC_EP_BULK_IN_SIZE),
+    },
+};
+
+// List of class descriptors
+const struct descriptor_s usb_class_descriptors[] PROGMEM = {
+    { USB_DT_DEVICE<<8, 0x0000,
+      &msc_device_descriptor, sizeof(msc_device_descriptor) },
+    { USB_DT_CONFIG<<8, 0x0000,
+      &msc_config_descriptor, sizeof(msc_config_descriptor) },
+};
+const uint8_t usb_class_descriptors_count = ARRAY_SIZE(usb_class_descriptors);
+
+
+/****************************************************************
+ * Mass storage class control requests
+ ****************************************************************/
+
+void
+usb_class_configure(void)
+{
+    MSC.state = MS_CBW;
+    usb_notify_bulk_out();
+}
+
+static void
+usb_req_clear_feature(struct usb_ctrlrequest *req)
+{
+    // The bulk endpoints are never halted, but clearing ENDPOINT_HALT
+    // must still reset the data toggle (the host resets its side too)
+    uint_fast16_t ep = req->wIndex;
+    if (req->bRequestType != 0x02 || req->wValue || req->wLength
+        || (ep != USB_CDC_EP_BULK_OUT
+            && ep != (USB_CDC_EP_BULK_IN | USB_DIR_IN))) {
+        usb_do_stall();
+        return;
+    }
+    usb_reset_bulk_toggle(ep);
+    usb_do_xfer(NULL, 0, UX_SEND);
+}
+
+static uint8_t msc_max_lun;
+
+static void
+usb_req_get_max_lun(struct usb_ctrlrequest *req)
+{
+    if (req->bRequestType != 0xa1 || req->wValue || req->wLength < 1) {
+        usb_do_stall();
+        return;
+    }
+    usb_do_xfer(&msc_max_lun, sizeof(msc_max_lun), UX_SEND);
+}
+
+static void
+usb_req_msc_reset(struct usb_ctrlrequest *req)
+{
+    if (req->bRequestType != 0x21 || req->wValue || req->wLength) {
+        usb_do_stall();
+        return;
+    }
+    MSC.state = MS_CBW;
+    usb_reset_bulk_toggle(USB_CDC_EP_BULK_OUT);
+    usb_reset_bulk_toggle(USB_CDC_EP_BULK_IN | USB_DIR_IN);
+    usb_notify_bulk_out();
+    usb_do_xfer(NULL, 0, UX_SEND);
+}
+
+void
+usb_class_request(struct usb_ctrlrequest *req)
+{
+    switch (req->bRequest) {
+    case USB_REQ_CLEAR_FEATURE: usb_req_clear_feature(req); break;
+    case USB_MSC_REQ_GET_MAX_LUN: usb_req_get_max_lun(req); break;
+    case USB_MSC_REQ_RESET: usb_req_msc_reset(req); break;
+    default: usb_do_stall(); break;
+    }
+}
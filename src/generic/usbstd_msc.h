@@ -0,0 +1,38 @@
+// Standard definitions for USB mass storage (bulk-only transport) devices
+#ifndef __GENERIC_USBSTD_MSC_H
+#define __GENERIC_USBSTD_MSC_H
+
+#define USB_MSC_SUBCLASS_SCSI 0x06
+
+#define USB_MSC_PROTO_BULK_ONLY 0x50
+
+#define USB_MSC_REQ_GET_MAX_LUN 0xfe
+#define USB_MSC_REQ_RESET 0xff
+
+#define USB_MSC_CBW_SIGNATURE 0x43425355
+#define USB_MSC_CSW_SIGNATURE 0x53425355
+
+#define USB_MSC_CBW_DIR_IN 0x80
+
+struct usb_msc_cbw {
+    uint32_t dCBWSignature;
+    uint32_t dCBWTag;
+    uint32_t dCBWDataTransferLength;
+    uint8_t bmCBWFlags;
+    uint8_t bCBWLUN;
+    uint8_t bCBWCBLength;
+    uint8_t CBWCB[16];
+} PACKED;
+
+enum {
+    USB_MSC_CSW_PASSED = 0, USB_MSC_CSW_FAILED = 1, USB_MSC_CSW_PHASE_ERROR = 2,
+};
+
+struct usb_msc_csw {
+    uint32_t dCSWSignature;
+    uint32_t dCSWTag;
+    uint32_t dCSWDataResidue;
+    uint8_t bCSWStatus;
+} PACKED;
+
+#endif // usbstd_msc.h
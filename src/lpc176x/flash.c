@@ -9,6 +9,7 @@
 #include "autoconf.h" // CONFIG_BLOCK_SIZE
 #include "flash.h" // flash_write_page
 #include "compiler.h" // ALIGN_DOWN
+#include "internal.h" // watchdog_reset
 
 #define IAP_LOCATION        0x1fff1ff1
 #define IAP_CMD_PREPARE     50
@@ -21,6 +22,7 @@ typedef void (*IAP)(uint32_t *, uint32_t *);
 static uint8_t iap_buf[IAP_BUF_MIN_SIZE] __aligned(4);
 static uint32_t next_address;
 static uint32_t page_write_count;
+static uint32_t prepared_start, prepared_end;
 
 // Return the flash sector index for the page at the given address
 static uint32_t
@@ -94,7 +96,9 @@ write_buffer(uint32_t flash_address, uint32_t* data, uint32_t len)
     uint32_t flash_sector_size = flash_get_sector_size(flash_address);
     uint32_t sector = flash_get_sector_index(flash_address);
     uint32_t page_address = ALIGN_DOWN(flash_address, flash_sector_size);
-    if (page_address == flash_address) {
+    int is_prepared = (flash_address >= prepared_start
+                       && flash_address < prepared_end);
+    if (page_address == flash_address && !is_prepared) {
         if (check_erased(flash_address, flash_sector_size)){
             // sector already erased
         }
@@ -124,6 +128,36 @@ write_buffer(uint32_t flash_address, uint32_t* data, uint32_t len)
     return 0;
 }
 
+// Erase all sectors covering the given range so that blocks within it
+// may subsequently be written in any order
+int
+flash_prepare_range(uint32_t start_address, uint32_t end_address)
+{
+    if (end_address <= start_address
+        || end_address > CONFIG_FLASH_START + CONFIG_FLASH_SIZE)
+        // Range is empty or extends past the end of flash
+        return -1;
+    uint32_t sector_address = start_address;
+    sector_address = ALIGN_DOWN(sector_address
+                                , flash_get_sector_size(sector_address));
+    prepared_start = sector_address;
+    while (sector_address < end_address) {
+        uint32_t flash_sector_size = flash_get_sector_size(sector_address);
+        if (!check_erased(sector_address, flash_sector_size)) {
+            // Each erase takes ~100ms - keep the 500ms watchdog fed
+            watchdog_reset();
+            uint32_t sector = flash_get_sector_index(sector_address);
+            unlock_flash(sector);
+            if (erase_sector(sector) != 0)
+                return -3;
+        }
+        page_write_count += 1;
+        sector_address += flash_sector_size;
+    }
+    prepared_end = sector_address;
+    return 0;
+}
+
 int
 flash_write_block(uint32_t block_address, uint32_t *data)
 {
@@ -24,5 +24,6 @@ void enable_pclock(uint32_t pclk);
 uint32_t get_pclock_frequency(uint32_t pclk);
 void gpio_peripheral(uint32_t gpio, int func, int pullup);
 void usb_disconnect(void);
+void watchdog_reset(void);
 
 #endif // internal.h
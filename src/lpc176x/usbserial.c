@@ -11,6 +11,7 @@
 #include "byteorder.h" // cpu_to_le32
 #include "command.h" // DECL_CONSTANT_STR
 #include "generic/usb_cdc.h" // usb_notify_ep0
+#include "generic/usbstd.h" // USB_DIR_IN
 #include "internal.h" // gpio_peripheral
 #include "sched.h" // DECL_INIT
 #include "usb_cdc_ep.h" // USB_CDC_EP_BULK_IN
@@ -243,6 +244,17 @@ usb_set_configure(void)
     usb_irq_enable();
 }
 
+// Reset the data toggle of a bulk endpoint (after a halt is cleared)
+void
+usb_reset_bulk_toggle(uint_fast8_t ep)
+{
+    // Setting an endpoint status of "not stalled" reinitializes it to DATA0
+    usb_irq_disable();
+    sie_cmd_write(SIE_CMD_SET_ENDPOINT_STATUS
+                  | (ep & USB_DIR_IN ? EP5IN : EP2OUT), 0);
+    usb_irq_enable();
+}
+
 // Force a USB disconnect (used during reboot into bootloader)
 void
 usb_disconnect(void)
@@ -39,6 +39,19 @@ flash_get_page_size(uint32_t addr)
     }
 }
 
+// Return the address just past the last flash page that may be erased
+static uint32_t
+flash_get_end(void)
+{
+    uint16_t *flash_size = (void*)FLASHSIZE_BASE;
+    uint32_t end = 0x08000000 + *flash_size * 1024;
+    if ((CONFIG_MACH_STM32F2 || CONFIG_MACH_STM32F4 || CONFIG_MACH_STM32H7)
+        && end > 0x08100000)
+        // erase_page() only supports sectors in the first 1MiB
+        end = 0x08100000;
+    return end;
+}
+
 // Check if the data at the given address has been erased (all 0xff)
 static int
 check_erased(uint32_t addr, uint32_t count)
@@ -179,6 +192,32 @@ write_block(uint32_t block_address, uint32_t *data)
 }
 
 static uint32_t page_write_count;
+static uint32_t prepared_start, prepared_end;
+
+// Erase all pages covering the given range so that blocks within it
+// may subsequently be written in any order
+int
+flash_prepare_range(uint32_t start_address, uint32_t end_address)
+{
+    if (end_address <= start_address || end_address > flash_get_end())
+        // Range is empty or extends past the end of flash
+        return -1;
+    uint32_t page_address = start_address;
+    page_address = ALIGN_DOWN(page_address, flash_get_page_size(page_address));
+    prepared_start = page_address;
+    while (page_address < end_address) {
+        uint32_t flash_page_size = flash_get_page_size(page_address);
+        if (!check_erased(page_address, flash_page_size)) {
+            unlock_flash();
+            erase_page(page_address);
+            lock_flash();
+        }
+        page_write_count++;
+        page_address += flash_page_size;
+    }
+    prepared_end = page_address;
+    return 0;
+}
 
 // Main block write interface
 int
@@ -189,10 +228,12 @@ flash_write_block(uint32_t block_address, uint32_t *data)
         return -1;
     uint32_t flash_page_size = flash_get_page_size(block_address);
     uint32_t page_address = ALIGN_DOWN(block_address, flash_page_size);
+    int is_prepared = (block_address >= prepared_start
+                       && block_address < prepared_end);
 
     // Check if erase is needed
     int need_erase = 0;
-    if (page_address == block_address) {
+    if (page_address == block_address && !is_prepared) {
         if (check_erased(block_address, flash_page_size)) {
             // Page already erased
         } else if (memcmp(data, (void*)block_address, CONFIG_BLOCK_SIZE) == 0
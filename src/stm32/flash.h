@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 
+int flash_prepare_range(uint32_t start_address, uint32_t end_address);
 int flash_write_block(uint32_t block_address, uint32_t *data);
 int flash_complete(void);
 
@@ -12,6 +12,7 @@
 #include "board/usb_cdc.h" // usb_notify_ep0
 #include "board/usb_cdc_ep.h" // USB_CDC_EP_BULK_IN
 #include "command.h" // DECL_CONSTANT_STR
+#include "generic/usbstd.h" // USB_DIR_IN
 #include "internal.h" // GPIO
 #include "sched.h" // DECL_INIT
 
@@ -280,6 +281,22 @@ usb_set_configure(void)
 {
 }
 
+// Reset the data toggle of a bulk endpoint (after a halt is cleared)
+void
+usb_reset_bulk_toggle(uint_fast8_t ep)
+{
+    // Toggle bits flip when written with 1 - write back the bits set
+    if (ep & USB_DIR_IN) {
+        uint32_t epr = USB_EPR[USB_CDC_EP_BULK_IN];
+        USB_EPR[USB_CDC_EP_BULK_IN] = ((epr & (EPR_RWBITS | USB_EP_DTOG_TX))
+                                       | EPR_RWCBITS);
+    } else {
+        uint32_t epr = USB_EPR[USB_CDC_EP_BULK_OUT];
+        USB_EPR[USB_CDC_EP_BULK_OUT] = ((epr & (EPR_RWBITS | USB_EP_DTOG_RX))
+                                        | EPR_RWCBITS);
+    }
+}
+
 
 /****************************************************************
  * Setup and interrupts
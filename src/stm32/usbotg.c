@@ -11,6 +11,7 @@
 #include "board/usb_cdc.h" // usb_notify_ep0
 #include "board/usb_cdc_ep.h" // USB_CDC_EP_BULK_IN
 #include "command.h" // DECL_CONSTANT_STR
+#include "generic/usbstd.h" // USB_DIR_IN
 #include "internal.h" // GPIO
 #include "sched.h" // DECL_INIT
 
@@ -42,6 +43,9 @@
   #define USBOTGEN RCC_AHB1ENR_USB2OTGHSEN
 #endif
 
+// The internal DMA engine is only present on the OTG_HS core
+#define USE_DMA (CONFIG_STM32_USB_OTG_DMA && IS_OTG_HS)
+
 static void
 usb_irq_disable(void)
 {
@@ -94,6 +98,8 @@ fifo_configure(void)
     fpos += ep_size;
 }
 
+#if !USE_DMA
+
 // Write a packet to a tx fifo
 static int_fast8_t
 fifo_write_packet(uint32_t ep, const uint8_t *src, uint32_t len)
@@ -186,11 +192,258 @@ peek_rx_queue(uint32_t ep)
     }
 }
 
+#endif // !USE_DMA
+
+
+/****************************************************************
+ * Internal DMA transfers
+ ****************************************************************/
+
+#if USE_DMA
+
+// Number of max size packets moved per bulk in DMA transfer.  Bulk out
+// is armed for a single packet - cdc hosts do not send a zero length
+// packet after a write that is a multiple of the packet size, so a
+// multi-packet out transfer could wait forever for the rest of its data.
+#define DMA_BULK_PACKETS 8
+#define DMA_BULK_OUT_SIZE USB_CDC_EP_BULK_OUT_SIZE
+#define DMA_BULK_IN_SIZE (DMA_BULK_PACKETS * USB_CDC_EP_BULK_IN_SIZE)
+
+// Buffers are cache line aligned so they can be cleaned/invalidated
+// without touching neighboring data.  They live in the normal ram region,
+// which on the stm32h7 is AXI SRAM and thus reachable by the OTG_HS DMA.
+static uint8_t ep0_out_buf[64] __aligned(32);
+static uint8_t ep0_in_buf[64] __aligned(32);
+static uint8_t bulk_out_buf[DMA_BULK_OUT_SIZE] __aligned(32);
+static uint8_t bulk_in_buf[2][DMA_BULK_IN_SIZE] __aligned(32);
+
+// Bulk in packets queued while a previous transfer is in progress
+static uint32_t bulk_in_fill, bulk_in_pend_len, bulk_in_pend_pkts;
+
+#define DAINT_OUT(EP) (1 << (USB_OTG_DAINTMSK_OEPM_Pos + (EP)))
+
+// Write back cached data before the DMA engine reads it
+static void
+dma_clean(void *buf, uint32_t len)
+{
+#if CONFIG_MACH_STM32H7
+    SCB_CleanDCache_by_Addr(buf, ALIGN(len, 32));
+#endif
+}
+
+// Discard stale cached data after the DMA engine wrote to memory
+static void
+dma_invalidate(void *buf, uint32_t len)
+{
+#if CONFIG_MACH_STM32H7
+    SCB_InvalidateDCache_by_Addr(buf, ALIGN(len, 32));
+#endif
+}
+
+// Start an "in" transfer of one or more packets
+static void
+dma_start_in(uint32_t ep, void *buf, uint32_t len, uint32_t pkts)
+{
+    USB_OTG_INEndpointTypeDef *epi = EPIN(ep);
+    dma_clean(buf, len);
+    epi->DIEPINT = USB_OTG_DIEPINT_XFRC;
+    epi->DIEPDMA = (uint32_t)buf;
+    epi->DIEPTSIZ = len | (pkts << USB_OTG_DIEPTSIZ_PKTCNT_Pos);
+    epi->DIEPCTL |= USB_OTG_DIEPCTL_EPENA | USB_OTG_DIEPCTL_CNAK;
+}
+
+// Arm ep0 to receive setup packets and "out" data
+static void
+dma_arm_ep0(void)
+{
+    USB_OTG_OUTEndpointTypeDef *epo = EPOUT(0);
+    epo->DOEPDMA = (uint32_t)ep0_out_buf;
+    epo->DOEPTSIZ = (64 | (3 << USB_OTG_DOEPTSIZ_STUPCNT_Pos)
+                     | (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos));
+    epo->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+}
+
+// Arm the bulk out endpoint to receive a packet
+static void
+dma_arm_bulk_out(void)
+{
+    USB_OTG_OUTEndpointTypeDef *epo = EPOUT(USB_CDC_EP_BULK_OUT);
+    epo->DOEPDMA = (uint32_t)bulk_out_buf;
+    epo->DOEPTSIZ = DMA_BULK_OUT_SIZE | (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos);
+    epo->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
+}
+
+// Start transmitting queued bulk in packets if the endpoint is idle
+static void
+dma_kick_bulk_in(void)
+{
+    if (!bulk_in_pend_pkts
+        || EPIN(USB_CDC_EP_BULK_IN)->DIEPCTL & USB_OTG_DIEPCTL_EPENA)
+        return;
+    dma_start_in(USB_CDC_EP_BULK_IN, bulk_in_buf[bulk_in_fill]
+                 , bulk_in_pend_len, bulk_in_pend_pkts);
+    bulk_in_fill ^= 1;
+    bulk_in_pend_len = bulk_in_pend_pkts = 0;
+}
+
+#endif // USE_DMA
+
 
 /****************************************************************
  * USB interface
  ****************************************************************/
 
+#if USE_DMA
+
+int_fast8_t
+usb_read_bulk_out(void *data, uint_fast8_t max_len)
+{
+    usb_irq_disable();
+    USB_OTG_OUTEndpointTypeDef *epo = EPOUT(USB_CDC_EP_BULK_OUT);
+    if (!(epo->DOEPINT & USB_OTG_DOEPINT_XFRC)) {
+        // Wait for packet
+        OTGD->DAINTMSK |= DAINT_OUT(USB_CDC_EP_BULK_OUT);
+        usb_irq_enable();
+        return -1;
+    }
+    epo->DOEPINT = USB_OTG_DOEPINT_XFRC;
+    uint32_t rem = epo->DOEPTSIZ & USB_OTG_DOEPTSIZ_XFRSIZ_Msk;
+    uint32_t len = DMA_BULK_OUT_SIZE - rem;
+    uint32_t xfer = len > max_len ? max_len : len;
+    dma_invalidate(bulk_out_buf, len);
+    memcpy(data, bulk_out_buf, xfer);
+    dma_arm_bulk_out();
+    usb_irq_enable();
+    return xfer;
+}
+
+int_fast8_t
+usb_send_bulk_in(void *data, uint_fast8_t len)
+{
+    usb_irq_disable();
+    uint32_t ctl = EPIN(USB_CDC_EP_BULK_IN)->DIEPCTL;
+    if (!(ctl & USB_OTG_DIEPCTL_USBAEP)) {
+        // Controller not enabled - discard data
+        usb_irq_enable();
+        return len;
+    }
+    dma_kick_bulk_in();
+    // Only full packets may be followed by more data in one transfer
+    uint32_t plen = bulk_in_pend_len, pkts = bulk_in_pend_pkts;
+    if (pkts && (pkts >= DMA_BULK_PACKETS || !len
+                 || plen != pkts * USB_CDC_EP_BULK_IN_SIZE)) {
+        // Wait for space to transmit
+        OTGD->DAINTMSK |= 1 << USB_CDC_EP_BULK_IN;
+        usb_irq_enable();
+        return -1;
+    }
+    memcpy(&bulk_in_buf[bulk_in_fill][plen], data, len);
+    bulk_in_pend_len = plen + len;
+    bulk_in_pend_pkts = pkts + 1;
+    dma_kick_bulk_in();
+    if (bulk_in_pend_pkts)
+        // Start queued packets on completion of current transfer
+        OTGD->DAINTMSK |= 1 << USB_CDC_EP_BULK_IN;
+    usb_irq_enable();
+    return len;
+}
+
+int_fast8_t
+usb_read_ep0(void *data, uint_fast8_t max_len)
+{
+    usb_irq_disable();
+    USB_OTG_OUTEndpointTypeDef *epo = EPOUT(0);
+    uint32_t doepint = epo->DOEPINT;
+    if (doepint & USB_OTG_DOEPINT_STUP) {
+        // Transfer interrupted
+        usb_irq_enable();
+        return -2;
+    }
+    if (!(doepint & USB_OTG_DOEPINT_XFRC)) {
+        // Wait for packet
+        OTGD->DAINTMSK |= DAINT_OUT(0);
+        usb_irq_enable();
+        return -1;
+    }
+    // Endpoint is rearmed after each packet so data is at buffer start
+    epo->DOEPINT = USB_OTG_DOEPINT_XFRC;
+    uint32_t rem = epo->DOEPTSIZ & USB_OTG_DOEPTSIZ_XFRSIZ_Msk;
+    uint32_t len = 64 - rem, xfer = len > max_len ? max_len : len;
+    dma_invalidate(ep0_out_buf, sizeof(ep0_out_buf));
+    memcpy(data, ep0_out_buf, xfer);
+    dma_arm_ep0();
+    usb_irq_enable();
+    return xfer;
+}
+
+int_fast8_t
+usb_read_ep0_setup(void *data, uint_fast8_t max_len)
+{
+    usb_irq_disable();
+    USB_OTG_OUTEndpointTypeDef *epo = EPOUT(0);
+    uint32_t doepint = epo->DOEPINT;
+    if (!(doepint & USB_OTG_DOEPINT_STUP)) {
+        if (doepint & USB_OTG_DOEPINT_XFRC) {
+            // The status stage of a control "in" transfer (or unexpected
+            // "out" data) completed and the core disabled the endpoint -
+            // discard it and rearm so the next setup packet is stored
+            epo->DOEPINT = USB_OTG_DOEPINT_XFRC;
+            dma_arm_ep0();
+        }
+        // Wait for packet
+        OTGD->DAINTMSK |= DAINT_OUT(0);
+        usb_irq_enable();
+        return -1;
+    }
+    // The DMA address advances past each setup packet received, so the
+    // most recent one is just before the current address
+    uint32_t pos = epo->DOEPDMA - (uint32_t)ep0_out_buf;
+    if (pos < 8 || pos > sizeof(ep0_out_buf))
+        pos = 8;
+    dma_invalidate(ep0_out_buf, sizeof(ep0_out_buf));
+    uint8_t setup_buf[8];
+    memcpy(setup_buf, &ep0_out_buf[pos - 8], sizeof(setup_buf));
+    uint32_t ctl = EPIN(0)->DIEPCTL;
+    if (ctl & USB_OTG_DIEPCTL_EPENA) {
+        // Flush any pending tx packets
+        EPIN(0)->DIEPCTL = ctl | USB_OTG_DIEPCTL_EPDIS | USB_OTG_DIEPCTL_SNAK;
+        while (EPIN(0)->DIEPCTL & USB_OTG_DIEPCTL_EPENA)
+            ;
+        OTG->GRSTCTL = USB_OTG_GRSTCTL_TXFFLSH;
+        while (OTG->GRSTCTL & USB_OTG_GRSTCTL_TXFFLSH)
+            ;
+    }
+    epo->DOEPINT = USB_OTG_DOEPINT_STUP | USB_OTG_DOEPINT_XFRC;
+    dma_arm_ep0();
+    usb_irq_enable();
+    memcpy(data, setup_buf, max_len);
+    return max_len;
+}
+
+int_fast8_t
+usb_send_ep0(const void *data, uint_fast8_t len)
+{
+    usb_irq_disable();
+    if (EPOUT(0)->DOEPINT & (USB_OTG_DOEPINT_STUP | USB_OTG_DOEPINT_XFRC)) {
+        // Transfer interrupted
+        usb_irq_enable();
+        return -2;
+    }
+    if (EPIN(0)->DIEPCTL & USB_OTG_DIEPCTL_EPENA) {
+        // Wait for space to transmit
+        OTGD->DAINTMSK |= DAINT_OUT(0) | (1 << 0);
+        usb_irq_enable();
+        return -1;
+    }
+    if (len)
+        memcpy(ep0_in_buf, data, len);
+    dma_start_in(0, ep0_in_buf, len, 1);
+    usb_irq_enable();
+    return len;
+}
+
+#else // USE_DMA
+
 int_fast8_t
 usb_read_bulk_out(void *data, uint_fast8_t max_len)
 {
@@ -318,6 +571,8 @@ usb_send_ep0(const void *data, uint_fast8_t len)
     return ret;
 }
 
+#endif // USE_DMA
+
 void
 usb_stall_ep0(void)
 {
@@ -352,11 +607,20 @@ usb_set_configure(void)
 
     // Configure and enable USB_CDC_EP_BULK_OUT
     USB_OTG_OUTEndpointTypeDef *epo = EPOUT(USB_CDC_EP_BULK_OUT);
+#if USE_DMA
+    epo->DOEPCTL = (
+        USB_OTG_DOEPCTL_USBAEP
+        | (0x02 << USB_OTG_DOEPCTL_EPTYP_Pos) | USB_OTG_DOEPCTL_SD0PID_SEVNFRM
+        | (USB_CDC_EP_BULK_OUT_SIZE << USB_OTG_DOEPCTL_MPSIZ_Pos));
+    dma_arm_bulk_out();
+    OTGD->DAINTMSK |= DAINT_OUT(USB_CDC_EP_BULK_OUT);
+#else
     epo->DOEPTSIZ = 64 | (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos);
     epo->DOEPCTL = (
         USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_USBAEP | USB_OTG_DOEPCTL_EPENA
         | (0x02 << USB_OTG_DOEPCTL_EPTYP_Pos) | USB_OTG_DOEPCTL_SD0PID_SEVNFRM
         | (USB_CDC_EP_BULK_OUT_SIZE << USB_OTG_DOEPCTL_MPSIZ_Pos));
+#endif
 
     // Configure and flush USB_CDC_EP_BULK_IN
     epi = EPIN(USB_CDC_EP_BULK_IN);
@@ -373,6 +637,21 @@ usb_set_configure(void)
                     | USB_OTG_GRSTCTL_TXFFLSH);
     while (OTG->GRSTCTL & USB_OTG_GRSTCTL_TXFFLSH)
         ;
+#if USE_DMA
+    bulk_in_pend_len = bulk_in_pend_pkts = 0;
+#endif
+    usb_irq_enable();
+}
+
+// Reset the data toggle of a bulk endpoint (after a halt is cleared)
+void
+usb_reset_bulk_toggle(uint_fast8_t ep)
+{
+    usb_irq_disable();
+    if (ep & USB_DIR_IN)
+        EPIN(USB_CDC_EP_BULK_IN)->DIEPCTL |= USB_OTG_DIEPCTL_SD0PID_SEVNFRM;
+    else
+        EPOUT(USB_CDC_EP_BULK_OUT)->DOEPCTL |= USB_OTG_DOEPCTL_SD0PID_SEVNFRM;
     usb_irq_enable();
 }
 
@@ -386,6 +665,21 @@ void
 OTG_FS_IRQHandler(void)
 {
     uint32_t sts = OTG->GINTSTS;
+#if USE_DMA
+    if (sts & (USB_OTG_GINTSTS_IEPINT | USB_OTG_GINTSTS_OEPINT)) {
+        // Transfer complete - disable irq and notify endpoint
+        uint32_t daint = OTGD->DAINT & OTGD->DAINTMSK;
+        OTGD->DAINTMSK &= ~daint;
+        if (daint & ((1 << 0) | DAINT_OUT(0)))
+            usb_notify_ep0();
+        if (daint & DAINT_OUT(USB_CDC_EP_BULK_OUT))
+            usb_notify_bulk_out();
+        if (daint & (1 << USB_CDC_EP_BULK_IN)) {
+            dma_kick_bulk_in();
+            usb_notify_bulk_in();
+        }
+    }
+#else
     if (sts & USB_OTG_GINTSTS_RXFLVL) {
         // Received data - disable irq and notify endpoint
         OTG->GINTMSK &= ~USB_OTG_GINTMSK_RXFLVLM;
@@ -404,6 +698,7 @@ OTG_FS_IRQHandler(void)
         if (daint & (1 << USB_CDC_EP_BULK_IN))
             usb_notify_bulk_in();
     }
+#endif
 }
 
 // Initialize the usb controller
@@ -444,6 +739,18 @@ usb_init(void)
     USB_OTG_INEndpointTypeDef *epi = EPIN(0);
     USB_OTG_OUTEndpointTypeDef *epo = EPOUT(0);
     epi->DIEPCTL = mpsize_ep0 | USB_OTG_DIEPCTL_SNAK;
+#if USE_DMA
+    epo->DOEPCTL = mpsize_ep0;
+    dma_arm_ep0();
+
+    // Enable interrupts and internal DMA (INCR4 bursts)
+    OTGD->DIEPMSK = USB_OTG_DIEPMSK_XFRCM;
+    OTGD->DOEPMSK = USB_OTG_DOEPMSK_XFRCM | USB_OTG_DOEPMSK_STUPM;
+    OTGD->DAINTMSK = DAINT_OUT(0);
+    OTG->GINTMSK = USB_OTG_GINTMSK_IEPINT | USB_OTG_GINTMSK_OEPINT;
+    OTG->GAHBCFG = (USB_OTG_GAHBCFG_GINT | USB_OTG_GAHBCFG_DMAEN
+                    | (0x03 << USB_OTG_GAHBCFG_HBSTLEN_Pos));
+#else
     epo->DOEPTSIZ = (64 | (1 << USB_OTG_DOEPTSIZ_STUPCNT_Pos)
                      | (1 << USB_OTG_DOEPTSIZ_PKTCNT_Pos));
     epo->DOEPCTL = mpsize_ep0 | USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_SNAK;
@@ -452,6 +759,7 @@ usb_init(void)
     OTGD->DIEPMSK = USB_OTG_DIEPMSK_XFRCM;
     OTG->GINTMSK = USB_OTG_GINTMSK_RXFLVLM | USB_OTG_GINTMSK_IEPINT;
     OTG->GAHBCFG = USB_OTG_GAHBCFG_GINT;
+#endif
     armcm_enable_irq(OTG_FS_IRQHandler, OTG_IRQn, 1);
 
     // Enable USB